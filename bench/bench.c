@@ -0,0 +1,164 @@
+/* isl_spatial2d benchmarks
+ *
+ * Build and run from this directory:
+ *   cc -O2 -I.. bench.c -o bench -lm && ./bench
+ *
+ * Only selected benchmarks are run when their names are passed:
+ *   ./bench lookup
+ *
+ * lookup - cell lookups per second of the built-in cell table, define BENCH_STB_DS and
+ *   put stb_ds.h on the include path to compare it with the stb_ds hash map:
+ *     cc -O2 -I.. -I/path/to/stb -DBENCH_STB_DS bench.c -o bench -lm
+ *
+ * keys - insert, update, query and pair finding with the key width the program is built
+ *   with, build it once more with 64 bit keys to get their cost:
+ *     cc -O2 -I.. -DISL_SPATIAL2D_KEY64 bench.c -o bench64 -lm && ./bench64 keys
+ *
+ * rebuild - frames where every entity moves, followed by pair finding, incremental
+ *   updates against rebuild mode at 10k, 100k and 1M entities
+ */
+#define ISL_SPATIAL2D_IMPLEMENTATION
+#include "isl_spatial2d.h"
+
+#ifdef BENCH_STB_DS
+#define STB_DS_IMPLEMENTATION
+#include "stb_ds.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double bench_seconds(clock_t start) {
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static unsigned bench_seed = 1;
+
+// Xorshift, so runs are reproducible across C libraries
+static int bench_rand(void) {
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return (int)(bench_seed & 0xffffff);
+}
+
+static isls2d_float bench_rnd(isls2d_float a, isls2d_float b) {
+	return a + (b - a) * (bench_rand() / (isls2d_float)0xffffff);
+}
+
+static bool bench_selected(int argc, char **argv, const char *name) {
+	if (argc < 2) return true;
+	for (int i = 1; i < argc; i++) if (strcmp(argv[i], name) == 0) return true;
+	return false;
+}
+
+#ifdef BENCH_STB_DS
+struct bench_stb_cell {
+	isls2d_key key;
+	int *value;
+};
+#endif
+
+// Random cells of the square are looked up, about a quarter of them is occupied
+static void bench_lookup(void) {
+	enum { CELLS = 1 << 16, SIDE = 1 << 9, LOOKUPS = 1 << 24 };
+	bench_seed = 1;
+	int *xs = (int *)malloc(LOOKUPS * sizeof(*xs)), *ys = (int *)malloc(LOOKUPS * sizeof(*ys));
+	for (int i = 0; i < LOOKUPS; i++) {
+		xs[i] = bench_rand() % SIDE - SIDE / 2;
+		ys[i] = bench_rand() % SIDE - SIDE / 2;
+	}
+	struct isls2d sh;
+	isls2d_init(&sh, 1, 1);
+	for (int i = 0; i < CELLS; i++) {
+		struct isls2d_cell *cell = isls2d__cell_put(&sh, xs[i], ys[i]);
+		isls2d__arrput(cell->ids, i);
+	}
+	long found = 0;
+	clock_t start = clock();
+	for (int i = 0; i < LOOKUPS; i++) found += isls2d__cell_get(&sh, xs[i], ys[i]) != NULL;
+	double t = bench_seconds(start);
+	printf("lookup   built-in table  %6.1f M lookups/s (%ld found)\n", LOOKUPS / t * 1e-6, found);
+	isls2d_clear(&sh);
+#ifdef BENCH_STB_DS
+	struct bench_stb_cell *cells = NULL;
+	for (int i = 0; i < CELLS; i++) hmput(cells, ISLS2D_KEY(xs[i], ys[i]), NULL);
+	found = 0;
+	start = clock();
+	for (int i = 0; i < LOOKUPS; i++) found += hmgeti(cells, ISLS2D_KEY(xs[i], ys[i])) >= 0;
+	t = bench_seconds(start);
+	printf("lookup   stb_ds hash map %6.1f M lookups/s (%ld found)\n", LOOKUPS / t * 1e-6, found);
+	hmfree(cells);
+#endif
+	free(xs);
+	free(ys);
+}
+
+// Mixed workload over the hashed grid, where the key width shows up in hashing, probing
+// and the size of cells
+static void bench_keys(void) {
+	enum { N = 100000, FRAMES = 20, QUERIES = 100000 };
+	isls2d_float world = 4000;
+	struct isls2d sh;
+	isls2d_init(&sh, 16, 16);
+	bench_seed = 1;
+	clock_t start = clock();
+	for (int i = 0; i < N; i++) isls2d_insert(&sh, bench_rnd(-world, world), bench_rnd(-world, world), bench_rnd(1, 12), bench_rnd(1, 12), NULL);
+	double insert = bench_seconds(start);
+	start = clock();
+	for (int f = 0; f < FRAMES; f++) {
+		for (int id = 0; id < N; id++) isls2d_update(&sh, id, sh.x[id] + bench_rnd(-4, 4), sh.y[id] + bench_rnd(-4, 4), sh.width[id], sh.height[id]);
+	}
+	double update = bench_seconds(start);
+	long found = 0;
+	start = clock();
+	for (int q = 0; q < QUERIES; q++) found += isls2d_query_rect_count(&sh, bench_rnd(-world, world), bench_rnd(-world, world), 64, 64, ISLS2D_MASK_ALL);
+	double query = bench_seconds(start);
+	const struct isls2d_pair *pairs;
+	start = clock();
+	int npairs = isls2d_find_pairs(&sh, &pairs);
+	double pair = bench_seconds(start);
+	printf("keys     %d bit keys, %d entities: insert %.1f ms, update %.1f ms/frame, %.2f us/query (%ld found), pairs %.1f ms (%d)\n",
+		(int)sizeof(isls2d_key) * 8, N, insert * 1e3, update * 1e3 / FRAMES, query * 1e6 / QUERIES, found, pair * 1e3, npairs);
+	isls2d_clear(&sh);
+}
+
+// Density is the same for every count, so only the scale changes
+static double bench_frames(int n, bool rebuild_mode, int frames, int *npairs) {
+	isls2d_float world = 8 * isls2d__sqrt((isls2d_float)n);
+	struct isls2d sh;
+	isls2d_init(&sh, 16, 16);
+	sh.rebuild_mode = rebuild_mode;
+	bench_seed = 1;
+	for (int i = 0; i < n; i++) isls2d_insert(&sh, bench_rnd(-world, world), bench_rnd(-world, world), bench_rnd(1, 12), bench_rnd(1, 12), NULL);
+	const struct isls2d_pair *pairs;
+	isls2d_find_pairs(&sh, &pairs);
+	clock_t start = clock();
+	for (int f = 0; f < frames; f++) {
+		for (int id = 0; id < n; id++) isls2d_update(&sh, id, sh.x[id] + bench_rnd(-4, 4), sh.y[id] + bench_rnd(-4, 4), sh.width[id], sh.height[id]);
+		*npairs = isls2d_find_pairs(&sh, &pairs);
+	}
+	double t = bench_seconds(start);
+	isls2d_clear(&sh);
+	return t / frames;
+}
+
+static void bench_rebuild(void) {
+	static const int counts[] = {10000, 100000, 1000000};
+	for (int i = 0; i < 3; i++) {
+		int n = counts[i], frames = n >= 1000000 ? 3 : 10, incremental_pairs, rebuild_pairs;
+		double incremental = bench_frames(n, false, frames, &incremental_pairs);
+		double rebuild = bench_frames(n, true, frames, &rebuild_pairs);
+		printf("rebuild  %7d entities: incremental %8.2f ms/frame, rebuild mode %8.2f ms/frame (%d/%d pairs)\n",
+			n, incremental * 1e3, rebuild * 1e3, incremental_pairs, rebuild_pairs);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (bench_selected(argc, argv, "lookup")) bench_lookup();
+	if (bench_selected(argc, argv, "keys")) bench_keys();
+	if (bench_selected(argc, argv, "rebuild")) bench_rebuild();
+	return 0;
+}
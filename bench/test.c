@@ -0,0 +1,757 @@
+/* isl_spatial2d brute force differential tests
+ *
+ * Build and run from this directory:
+ *   cc -O2 -I.. test.c -o test -lm -lpthread && ./test
+ *
+ * Random inserts, updates, batch updates, removes, sleeps and filter changes are applied
+ * to the grid and to the plain array of boxes, every query, raycast, kNN, pair search,
+ * contacts drain and snapshot of the grid is compared with the brute force answer over
+ * the array. Every grid mode and their combinations are run, build it with other defines
+ * to check them too:
+ *   cc -O2 -I.. -DISL_SPATIAL2D_KEY64 test.c -o test64 -lm -lpthread && ./test64
+ *   cc -O2 -I.. -DISL_SPATIAL2D_DOUBLE test.c -o testd -lm -lpthread && ./testd
+ *   cc -O2 -I.. -mavx2 test.c -o testavx -lm -lpthread && ./testavx
+ *   cc -O2 -I.. -DISL_SPATIAL2D_NO_SIMD test.c -o testscalar -lm -lpthread && ./testscalar
+ *
+ * Parallel rebuild, concurrent changes and concurrent snapshot queries run on pthreads,
+ * build with sanitizers to check them for races:
+ *   cc -O1 -g -I.. -fsanitize=thread test.c -o testtsan -lm -lpthread && ./testtsan
+ *
+ * Only selected tests are run when their names are passed:
+ *   ./test modes concurrent snapshot
+ */
+#define ISL_SPATIAL2D_IMPLEMENTATION
+#include "isl_spatial2d.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_IDS 4096
+#define TEST_THREADS 4
+
+struct test_entity {
+	bool live;
+	bool is_static;
+	bool sleeping;
+	isls2d_float x;
+	isls2d_float y;
+	isls2d_float width;
+	isls2d_float height;
+	isls2d_mask category;
+	isls2d_mask mask;
+	int serial;
+};
+
+struct test_config {
+	char name[64];
+	bool bounded;
+	bool hierarchical;
+	bool loose;
+	bool rebuild;
+	bool parallel;
+	bool margin;
+	bool track;
+	bool far;
+};
+
+static struct test_entity test_model[TEST_IDS];
+static const struct test_config *test_current;
+static int test_step;
+static int test_failures;
+
+// Ids of entities removed since the previous drain must not be reused, contacts are kept
+// by serials of entities
+static bool test_removed[TEST_IDS];
+static int test_serial_at[TEST_IDS];
+static long long *test_contacts;
+static int test_contacts_count;
+static int test_contacts_capacity;
+
+static unsigned test_seed = 1;
+// Far grids are moved beyond the range of 16 bit cell coordinates of keys
+static isls2d_float test_origin;
+
+// Xorshift, so runs are reproducible across C libraries
+static int test_rand(void) {
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 17;
+	test_seed ^= test_seed << 5;
+	return (int)(test_seed & 0xffffff);
+}
+
+static isls2d_float test_rnd(isls2d_float a, isls2d_float b) {
+	return a + (b - a) * (test_rand() / (isls2d_float)0xffffff);
+}
+
+static isls2d_float test_x(isls2d_float a, isls2d_float b) {
+	return test_origin + test_rnd(a, b);
+}
+
+static bool test_selected(int argc, char **argv, const char *name) {
+	if (argc < 2) return true;
+	for (int i = 1; i < argc; i++) if (strcmp(argv[i], name) == 0) return true;
+	return false;
+}
+
+static bool test_check(bool ok, const char *what) {
+	if (ok) return true;
+	if (test_failures++ < 20) printf("FAIL %s, step %d: %s\n", test_current ? test_current->name : "-", test_step, what);
+	return false;
+}
+
+static int test_compare_ints(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+static int test_compare_longs(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+static int test_compare_floats(const void *a, const void *b) {
+	isls2d_float x = *(const isls2d_float *)a, y = *(const isls2d_float *)b;
+	return (x > y) - (x < y);
+}
+
+// Sorts both id lists and compares them, duplicates in the grid answer are errors
+static bool test_same_ids(int *got, int ngot, int *expected, int nexpected) {
+	qsort(got, ngot, sizeof(*got), test_compare_ints);
+	qsort(expected, nexpected, sizeof(*expected), test_compare_ints);
+	return ngot == nexpected && (ngot == 0 || memcmp(got, expected, ngot * sizeof(*got)) == 0);
+}
+
+static bool test_idle(int id) {
+	return test_model[id].is_static || test_model[id].sleeping;
+}
+
+static bool test_accepts(int a, int b) {
+	return (test_model[a].category & test_model[b].mask) && (test_model[b].category & test_model[a].mask);
+}
+
+static bool test_overlaps(int a, int b) {
+	const struct test_entity *ea = &test_model[a], *eb = &test_model[b];
+	return isls2d_overlaps(ea->x, ea->y, ea->width, ea->height, eb->x, eb->y, eb->width, eb->height);
+}
+
+static void test_box(struct isls2d_box *box) {
+	int kind = test_rand() % 16;
+	box->x = test_x(-300, 300);
+	box->y = test_rnd(-300, 300);
+	box->width = test_rnd(0.5f, 12);
+	box->height = test_rnd(0.5f, 12);
+	// A few huge and degenerate boxes for levels, loose extents and border cells
+	if (kind == 0) {
+		box->width = test_rnd(24, 100);
+		box->height = test_rnd(24, 100);
+	} else if (kind == 1) {
+		box->width = 0;
+	} else if (kind == 2) {
+		box->x = test_x(-600, 600);
+		box->y = test_rnd(-600, 600);
+	}
+}
+
+static void test_parallel_for(isls2d_task_fn task, void *task_data, int count, void *udata);
+
+static void test_init(struct isls2d *sh, const struct test_config *config) {
+	test_origin = config->far ? 40000 * 16 : 0;
+	if (config->bounded) isls2d_init_bounded(sh, 16, 16, test_origin - 256, -256, 512, 512);
+	else if (config->hierarchical) isls2d_init_hierarchical(sh, 4, 4, 6);
+	else isls2d_init(sh, 16, 16);
+	sh->loose = config->loose;
+	sh->rebuild_mode = config->rebuild;
+	sh->track_overlap = config->track;
+	if (config->margin) sh->margin = 3;
+	if (config->parallel) {
+		sh->parallel = test_parallel_for;
+		sh->tasks = 7;
+	}
+	memset(test_model, 0, sizeof(test_model));
+	memset(test_removed, 0, sizeof(test_removed));
+	test_contacts_count = 0;
+}
+
+static void test_insert(struct isls2d *sh, bool is_static) {
+	static int serial;
+	struct isls2d_box b;
+	test_box(&b);
+	int id = is_static ? isls2d_insert_static(sh, b.x, b.y, b.width, b.height, NULL) : isls2d_insert(sh, b.x, b.y, b.width, b.height, NULL);
+	if (!test_check(id >= 0 && id < TEST_IDS && !test_model[id].live, "insert returned the live id")) return;
+	test_check(!test_removed[id], "id of the removed entity reused before the drain");
+	struct test_entity e = {true, is_static, false, b.x, b.y, b.width, b.height, ISLS2D_MASK_ALL, ISLS2D_MASK_ALL, ++serial};
+	test_model[id] = e;
+	test_serial_at[id] = e.serial;
+}
+
+static int test_live_id(int count) {
+	for (int tries = 0; tries < 64; tries++) {
+		int id = test_rand() % count;
+		if (test_model[id].live) return id;
+	}
+	return -1;
+}
+
+static void test_moved(int id, struct isls2d_box *box) {
+	struct test_entity *e = &test_model[id];
+	// Small moves keep cells, jumps and resizes don't
+	if (test_rand() % 4) {
+		box->x = e->x + test_rnd(-4, 4);
+		box->y = e->y + test_rnd(-4, 4);
+		box->width = e->width;
+		box->height = e->height;
+	} else {
+		test_box(box);
+	}
+}
+
+static void test_apply(int id, const struct isls2d_box *box) {
+	struct test_entity *e = &test_model[id];
+	if (e->x == box->x && e->y == box->y && e->width == box->width && e->height == box->height) return;
+	e->x = box->x;
+	e->y = box->y;
+	e->width = box->width;
+	e->height = box->height;
+	e->sleeping = false;
+}
+
+// Random change of the grid mirrored in the model
+static void test_change(struct isls2d *sh) {
+	int count = isls2d__arrlen(sh->entities), op = test_rand() % 100, id = count ? test_live_id(count) : -1;
+	if (op < 30 || id < 0) {
+		test_insert(sh, false);
+	} else if (op < 34) {
+		test_insert(sh, true);
+	} else if (op < 46) {
+		isls2d_remove(sh, id);
+		test_model[id].live = false;
+		if (sh->track_overlap) test_removed[id] = true;
+	} else if (op < 76) {
+		struct isls2d_box box;
+		test_moved(id, &box);
+		// Same box of the sleeping entity is skipped without waking it
+		if (test_rand() % 8 == 0) {
+			box.x = test_model[id].x;
+			box.y = test_model[id].y;
+			box.width = test_model[id].width;
+			box.height = test_model[id].height;
+		}
+		isls2d_update(sh, id, box.x, box.y, box.width, box.height);
+		test_apply(id, &box);
+	} else if (op < 86) {
+		int ids[16], n = 1 + test_rand() % 16;
+		struct isls2d_box boxes[16];
+		for (int i = 0; i < n; i++) {
+			// Repeated ids are applied in order
+			ids[i] = i > 0 && test_rand() % 8 == 0 ? ids[test_rand() % i] : test_live_id(count);
+			if (ids[i] < 0) ids[i] = id;
+			test_moved(ids[i], &boxes[i]);
+		}
+		isls2d_update_batch(sh, ids, boxes, n);
+		for (int i = 0; i < n; i++) test_apply(ids[i], &boxes[i]);
+	} else if (op < 93) {
+		if (test_model[id].is_static) return;
+		if (test_rand() % 2) {
+			isls2d_sleep(sh, id);
+			test_model[id].sleeping = true;
+		} else {
+			isls2d_wake(sh, id);
+			test_model[id].sleeping = false;
+		}
+	} else {
+		isls2d_mask category = (isls2d_mask)1 << (test_rand() % 4), mask = (isls2d_mask)(test_rand() % 16);
+		if (test_rand() % 4 == 0) category = mask = ISLS2D_MASK_ALL;
+		isls2d_set_filter(sh, id, category, mask);
+		test_model[id].category = category;
+		test_model[id].mask = mask;
+	}
+}
+
+static isls2d_mask test_query_mask(void) {
+	return test_rand() % 2 ? ISLS2D_MASK_ALL : (isls2d_mask)(test_rand() % 16);
+}
+
+static int test_collect(int id, const void *data, void *udata) {
+	int *ids = (int *)udata;
+	(void)data;
+	if (ids[0] < TEST_IDS) ids[++ids[0]] = id;
+	return 0;
+}
+
+static void test_rects(struct isls2d *sh, const struct isls2d_snapshot *snap) {
+	static int got[TEST_IDS + 1], expected[TEST_IDS];
+	int count = isls2d__arrlen(sh->entities);
+	for (int q = 0; q < 4; q++) {
+		isls2d_float x = test_x(-350, 350), y = test_rnd(-350, 350), width = test_rnd(0, 80), height = test_rnd(0, 80);
+		isls2d_mask mask = test_query_mask();
+		int n = 0;
+		for (int id = 0; id < count; id++) {
+			const struct test_entity *e = &test_model[id];
+			if (e->live && (e->category & mask) && isls2d_overlaps(x, y, width, height, e->x, e->y, e->width, e->height)) expected[n++] = id;
+		}
+		got[0] = 0;
+		if (snap) {
+			isls2d_snapshot_query_rect_each(snap, x, y, width, height, mask, test_collect, got);
+			test_check(test_same_ids(got + 1, got[0], expected, n), "snapshot rect query");
+			continue;
+		}
+		isls2d_query_rect_each(sh, x, y, width, height, mask, test_collect, got);
+		test_check(test_same_ids(got + 1, got[0], expected, n), "rect query");
+		test_check(isls2d_query_rect_count(sh, x, y, width, height, mask) == n, "rect count");
+		test_check(isls2d_query_rect_any(sh, x, y, width, height, mask) == (n > 0), "rect any");
+	}
+}
+
+static void test_circles(struct isls2d *sh, const struct isls2d_snapshot *snap) {
+	static int got[TEST_IDS + 1], expected[TEST_IDS];
+	int count = isls2d__arrlen(sh->entities);
+	for (int q = 0; q < 4; q++) {
+		isls2d_float x = test_x(-350, 350), y = test_rnd(-350, 350), radius = test_rnd(0, 60);
+		isls2d_mask mask = test_query_mask();
+		int n = 0;
+		for (int id = 0; id < count; id++) {
+			const struct test_entity *e = &test_model[id];
+			if (!e->live || !(e->category & mask)) continue;
+			if (!isls2d_overlaps(x - radius, y - radius, 2 * radius, 2 * radius, e->x, e->y, e->width, e->height)) continue;
+			if (isls2d__circle_overlaps(x, y, radius, e->x, e->y, e->width, e->height)) expected[n++] = id;
+		}
+		got[0] = 0;
+		if (snap) {
+			isls2d_snapshot_query_circle_each(snap, x, y, radius, mask, test_collect, got);
+			test_check(test_same_ids(got + 1, got[0], expected, n), "snapshot circle query");
+			continue;
+		}
+		isls2d_query_circle_each(sh, x, y, radius, mask, test_collect, got);
+		test_check(test_same_ids(got + 1, got[0], expected, n), "circle query");
+		test_check(isls2d_query_circle_count(sh, x, y, radius, mask) == n, "circle count");
+		test_check(isls2d_query_circle_any(sh, x, y, radius, mask) == (n > 0), "circle any");
+	}
+}
+
+static bool test_contains(int id, isls2d_float x, isls2d_float y) {
+	const struct test_entity *e = &test_model[id];
+	return x >= e->x && x < e->x + e->width && y >= e->y && y < e->y + e->height;
+}
+
+static int test_collect_point(int point, int id, const void *data, void *udata) {
+	long long *pairs = (long long *)udata;
+	(void)data;
+	if (pairs[0] < TEST_IDS) pairs[++pairs[0]] = (long long)point << 32 | id;
+	return 0;
+}
+
+static void test_points(struct isls2d *sh) {
+	static int got[TEST_IDS + 1], expected[TEST_IDS];
+	static long long got_pairs[TEST_IDS + 1], expected_pairs[TEST_IDS];
+	struct isls2d_point points[8];
+	int count = isls2d__arrlen(sh->entities), npairs = 0;
+	isls2d_mask mask = test_query_mask();
+	for (int i = 0; i < 8; i++) {
+		// Some points share cells
+		points[i].x = i > 0 && test_rand() % 3 == 0 ? points[i - 1].x + test_rnd(0, 2) : test_x(-350, 350);
+		points[i].y = i > 0 && test_rand() % 3 == 0 ? points[i - 1].y + test_rnd(0, 2) : test_rnd(-350, 350);
+		int n = 0;
+		for (int id = 0; id < count; id++) {
+			if (!test_model[id].live || !(test_model[id].category & mask) || !test_contains(id, points[i].x, points[i].y)) continue;
+			expected[n++] = id;
+			expected_pairs[npairs++] = (long long)i << 32 | id;
+		}
+		got[0] = 0;
+		isls2d_query_point_each(sh, points[i].x, points[i].y, mask, test_collect, got);
+		test_check(test_same_ids(got + 1, got[0], expected, n), "point query");
+	}
+	got_pairs[0] = 0;
+	isls2d_query_points_each(sh, points, 8, mask, test_collect_point, got_pairs);
+	qsort(got_pairs + 1, got_pairs[0], sizeof(*got_pairs), test_compare_longs);
+	qsort(expected_pairs, npairs, sizeof(*expected_pairs), test_compare_longs);
+	test_check(got_pairs[0] == npairs && (npairs == 0 || memcmp(got_pairs + 1, expected_pairs, npairs * sizeof(*expected_pairs)) == 0), "batched point query");
+}
+
+// Same slab test as the raycast, so hit parameters are compared exactly
+static bool test_ray_hit(int id, isls2d_float x, isls2d_float y, isls2d_float dx, isls2d_float dy, isls2d_float max_t, isls2d_float *t) {
+	const struct test_entity *e = &test_model[id];
+	isls2d_float inv_dx = dx != 0 ? 1 / dx : 0, inv_dy = dy != 0 ? 1 / dy : 0, tmin = 0, tmax = max_t;
+	if (dx != 0) {
+		isls2d_float t1 = (e->x - x) * inv_dx, t2 = (e->x + e->width - x) * inv_dx;
+		if (t1 > t2) { isls2d_float s = t1; t1 = t2; t2 = s; }
+		if (t1 > tmin) tmin = t1;
+		if (t2 < tmax) tmax = t2;
+	} else if (x < e->x || x > e->x + e->width) {
+		return false;
+	}
+	if (dy != 0) {
+		isls2d_float t1 = (e->y - y) * inv_dy, t2 = (e->y + e->height - y) * inv_dy;
+		if (t1 > t2) { isls2d_float s = t1; t1 = t2; t2 = s; }
+		if (t1 > tmin) tmin = t1;
+		if (t2 < tmax) tmax = t2;
+	} else if (y < e->y || y > e->y + e->height) {
+		return false;
+	}
+	*t = tmin;
+	return tmin <= tmax;
+}
+
+static void test_rays(struct isls2d *sh) {
+	static isls2d_float expected[TEST_IDS];
+	struct isls2d_hit hits[8];
+	int count = isls2d__arrlen(sh->entities);
+	for (int q = 0; q < 4; q++) {
+		isls2d_float x = test_x(-350, 350), y = test_rnd(-350, 350), angle = test_rnd(0, 6.2831853f), t;
+		isls2d_float dx = cos(angle), dy = sin(angle), max_t = test_rand() % 8 ? test_rnd(0, 400) : INFINITY;
+		int kind = test_rand() % 8, max_hits = 1 + test_rand() % 8, n = 0;
+		if (kind == 0) dx = 0, dy = 1;
+		else if (kind == 1) dx = -1, dy = 0;
+		isls2d_mask mask = test_query_mask();
+		for (int id = 0; id < count; id++) {
+			if (test_model[id].live && (test_model[id].category & mask) && test_ray_hit(id, x, y, dx, dy, max_t, &t)) expected[n++] = t;
+		}
+		qsort(expected, n, sizeof(*expected), test_compare_floats);
+		int got = isls2d_raycast(sh, x, y, dx, dy, max_t, mask, hits, max_hits);
+		bool ok = got == (n < max_hits ? n : max_hits);
+		// Ids of equally distant hits may differ, so hits are checked one by one
+		for (int i = 0; ok && i < got; i++) {
+			ok = hits[i].t == expected[i] && test_model[hits[i].id].live && test_ray_hit(hits[i].id, x, y, dx, dy, max_t, &t) && t == hits[i].t;
+			for (int j = 0; ok && j < i; j++) ok = hits[j].id != hits[i].id;
+		}
+		test_check(ok, "raycast");
+	}
+}
+
+static void test_knn(struct isls2d *sh) {
+	static isls2d_float expected[TEST_IDS];
+	struct isls2d_neighbor neighbors[8];
+	int count = isls2d__arrlen(sh->entities);
+	for (int q = 0; q < 4; q++) {
+		isls2d_float x = test_x(-350, 350), y = test_rnd(-350, 350), max_distance = test_rand() % 4 ? test_rnd(0, 200) : 1e9f;
+		int k = 1 + test_rand() % 8, n = 0;
+		isls2d_mask mask = test_query_mask();
+		for (int id = 0; id < count; id++) {
+			const struct test_entity *e = &test_model[id];
+			if (!e->live || !(e->category & mask)) continue;
+			isls2d_float dx = x < e->x ? e->x - x : (x > e->x + e->width ? x - e->x - e->width : 0);
+			isls2d_float dy = y < e->y ? e->y - y : (y > e->y + e->height ? y - e->y - e->height : 0);
+			isls2d_float d2 = dx * dx + dy * dy;
+			if (d2 <= max_distance * max_distance) expected[n++] = d2;
+		}
+		qsort(expected, n, sizeof(*expected), test_compare_floats);
+		int got = isls2d_query_knn(sh, x, y, k, max_distance, mask, neighbors);
+		bool ok = got == (n < k ? n : k);
+		for (int i = 0; ok && i < got; i++) {
+			ok = neighbors[i].distance == isls2d__sqrt(expected[i]) && test_model[neighbors[i].id].live;
+			for (int j = 0; ok && j < i; j++) ok = neighbors[j].id != neighbors[i].id;
+		}
+		test_check(ok, "knn query");
+	}
+}
+
+static void test_pairs(struct isls2d *sh) {
+	static long long got[TEST_IDS * 16], expected[TEST_IDS * 16];
+	const struct isls2d_pair *pairs;
+	int count = isls2d__arrlen(sh->entities), n = 0, m = isls2d_find_pairs(sh, &pairs);
+	for (int a = 0; a < count; a++) {
+		if (!test_model[a].live) continue;
+		for (int b = a + 1; b < count && n < TEST_IDS * 16; b++) {
+			if (test_model[b].live && !(test_idle(a) && test_idle(b)) && test_accepts(a, b) && test_overlaps(a, b)) expected[n++] = (long long)a << 32 | b;
+		}
+	}
+	bool ok = m == n;
+	for (int i = 0; ok && i < m; i++) {
+		ok = pairs[i].a < pairs[i].b;
+		got[i] = (long long)pairs[i].a << 32 | pairs[i].b;
+	}
+	if (ok) {
+		qsort(got, m, sizeof(*got), test_compare_longs);
+		qsort(expected, n, sizeof(*expected), test_compare_longs);
+		ok = m == 0 || memcmp(got, expected, m * sizeof(*got)) == 0;
+	}
+	test_check(ok, "pairs");
+}
+
+static long long test_contact_key(int a, int b) {
+	int sa = test_serial_at[a], sb = test_serial_at[b];
+	return sa < sb ? (long long)sa << 32 | sb : (long long)sb << 32 | sa;
+}
+
+static int test_contact_find(long long key) {
+	int l = 0, r = test_contacts_count - 1;
+	while (l <= r) {
+		int m = (l + r) >> 1;
+		if (test_contacts[m] < key) l = m + 1;
+		else if (test_contacts[m] > key) r = m - 1;
+		else return m;
+	}
+	return -l - 1;
+}
+
+// Drained events are applied to the contacts of the previous drain, entities are matched
+// by serials, so events of an entity which left and of the new one under its id differ
+static void test_drain(struct isls2d *sh) {
+	static long long got[TEST_IDS * 16];
+	struct isls2d_contacts contacts = isls2d_drain_contacts(sh);
+	int count = isls2d__arrlen(sh->entities), n = 0;
+	bool ok = true;
+	for (int i = 0; i < contacts.ended_count && ok; i++) {
+		int k = test_contact_find(test_contact_key(contacts.ended[i].a, contacts.ended[i].b));
+		ok = contacts.ended[i].a < contacts.ended[i].b && k >= 0;
+		if (ok) memmove(&test_contacts[k], &test_contacts[k + 1], (--test_contacts_count - k) * sizeof(*test_contacts));
+	}
+	test_check(ok, "ended contact wasn't in contact");
+	for (int i = 0; i < contacts.began_count && ok; i++) {
+		int k = test_contact_find(test_contact_key(contacts.began[i].a, contacts.began[i].b));
+		ok = contacts.began[i].a < contacts.began[i].b && k < 0;
+		if (!ok) break;
+		k = -k - 1;
+		if (test_contacts_count == test_contacts_capacity) {
+			test_contacts_capacity = test_contacts_capacity ? 2 * test_contacts_capacity : 64;
+			test_contacts = (long long *)realloc(test_contacts, test_contacts_capacity * sizeof(*test_contacts));
+		}
+		memmove(&test_contacts[k + 1], &test_contacts[k], (test_contacts_count++ - k) * sizeof(*test_contacts));
+		test_contacts[k] = test_contact_key(contacts.began[i].a, contacts.began[i].b);
+	}
+	test_check(ok, "began contact was already in contact");
+	memset(test_removed, 0, sizeof(test_removed));
+	// Contacts given by the events are the current overlaps of entities
+	for (int a = 0; a < count; a++) {
+		if (!test_model[a].live) continue;
+		const int *overlaps = sh->entities[a].overlaps;
+		for (int i = 0; i < isls2d__arrlen(overlaps) && n < TEST_IDS * 16; i++) {
+			int b = overlaps[i];
+			if (a < b) got[n++] = test_contact_key(a, b);
+			// Pairs with at least one moving entity are in contact exactly while they overlap,
+			// idle ones only keep their contacts
+			ok = ok && test_model[b].live && test_accepts(a, b) && test_overlaps(a, b);
+		}
+		for (int b = a + 1; b < count; b++) {
+			if (!test_model[b].live || (test_idle(a) && test_idle(b)) || !test_accepts(a, b) || !test_overlaps(a, b)) continue;
+			int *found = (int *)bsearch(&b, overlaps, isls2d__arrlen(overlaps), sizeof(*overlaps), test_compare_ints);
+			ok = ok && found != NULL;
+		}
+	}
+	test_check(ok, "contacts");
+	qsort(got, n, sizeof(*got), test_compare_longs);
+	test_check(n == test_contacts_count && (n == 0 || memcmp(got, test_contacts, n * sizeof(*got)) == 0), "drained events");
+}
+
+struct test_parallel_job {
+	isls2d_task_fn task;
+	void *task_data;
+	int count;
+	int thread;
+};
+
+static void *test_parallel_thread(void *arg) {
+	struct test_parallel_job *job = (struct test_parallel_job *)arg;
+	for (int i = job->thread; i < job->count; i += TEST_THREADS) job->task(job->task_data, i);
+	return NULL;
+}
+
+// Tasks are spread over fresh threads on every call, which is enough for tests
+static void test_parallel_for(isls2d_task_fn task, void *task_data, int count, void *udata) {
+	pthread_t threads[TEST_THREADS];
+	struct test_parallel_job jobs[TEST_THREADS];
+	(void)udata;
+	for (int t = 0; t < TEST_THREADS; t++) {
+		struct test_parallel_job job = {task, task_data, count, t};
+		jobs[t] = job;
+		pthread_create(&threads[t], NULL, test_parallel_thread, &jobs[t]);
+	}
+	for (int t = 0; t < TEST_THREADS; t++) pthread_join(threads[t], NULL);
+}
+
+static void test_mode(const struct test_config *config) {
+	struct isls2d sh;
+	struct isls2d_snapshot snap = {0};
+	int failures = test_failures;
+	test_current = config;
+	test_seed = 1;
+	test_init(&sh, config);
+	for (test_step = 0; test_step < 300 && test_failures == failures; test_step++) {
+		for (int i = test_step < 40 ? 8 : 2; i > 0; i--) test_change(&sh);
+		test_rects(&sh, NULL);
+		test_circles(&sh, NULL);
+		test_points(&sh);
+		test_rays(&sh);
+		test_knn(&sh);
+		if (test_step % 4 == 0) test_pairs(&sh);
+		if (config->track && test_rand() % 3 == 0) test_drain(&sh);
+		if (test_step % 16 == 0) {
+			isls2d_snapshot_take(&sh, &snap);
+			test_rects(&sh, &snap);
+			test_circles(&sh, &snap);
+		}
+	}
+	isls2d_snapshot_clear(&snap);
+	isls2d_clear(&sh);
+	if (test_failures == failures) printf("ok   %s\n", config->name);
+}
+
+static void test_modes(void) {
+	for (int i = 0; i < 192; i++) {
+		struct test_config config = {"", i % 3 == 1, i % 3 == 2, (i / 3) & 1, (i / 6) & 1, (i / 12) & 1, (i / 24) & 1, (i / 48) & 1, (i / 96) & 1};
+		// Hierarchy is hashed only, far grid is bounded only
+		if ((config.hierarchical && config.rebuild) || (config.far && !config.bounded)) continue;
+		snprintf(config.name, sizeof(config.name), "%s%s%s%s%s%s%s", config.bounded ? "bounded" : (config.hierarchical ? "hierarchical" : "hashed"),
+			config.far ? " far" : "", config.loose ? " loose" : "", config.rebuild ? " rebuild" : "", config.parallel ? " parallel" : "", config.margin ? " margin" : "", config.track ? " contacts" : "");
+		test_mode(&config);
+	}
+}
+
+struct test_worker {
+	struct isls2d *sh;
+	unsigned seed;
+	int ids[64];
+};
+
+// Every worker changes only its own entities, model entries are written by the owner
+static void *test_concurrent_thread(void *arg) {
+	struct test_worker *worker = (struct test_worker *)arg;
+	unsigned seed = worker->seed;
+	for (int i = 0; i < 64; i++) worker->ids[i] = -1;
+	for (int step = 0; step < 4000; step++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		int slot = seed % 64, id = worker->ids[slot];
+		isls2d_float x = (isls2d_float)(int)(seed >> 8 & 511) - 256, y = (isls2d_float)(int)(seed >> 17 & 511) - 256, size = 1 + (seed >> 26 & 15);
+		if (id < 0) {
+			id = isls2d_insert_concurrent(worker->sh, x, y, size, size, NULL);
+			if (id < 0) continue;
+			struct test_entity e = {true, false, false, x, y, size, size, ISLS2D_MASK_ALL, ISLS2D_MASK_ALL, 0};
+			test_model[id] = e;
+			worker->ids[slot] = id;
+		} else if (seed >> 30 == 0) {
+			test_model[id].live = false;
+			isls2d_remove_concurrent(worker->sh, id);
+			worker->ids[slot] = -1;
+		} else {
+			// Mostly small moves
+			if (seed >> 29 & 1) x = test_model[id].x + (isls2d_float)(int)(seed >> 3 & 7) - 3.5f, y = test_model[id].y + 1;
+			isls2d_update_concurrent(worker->sh, id, x, y, size, size);
+			test_model[id].x = x;
+			test_model[id].y = y;
+			test_model[id].width = test_model[id].height = size;
+		}
+	}
+	return NULL;
+}
+
+static void test_concurrent(void) {
+	for (int i = 0; i < 4; i++) {
+		struct test_config config = {"", i & 1, false, false, false, false, (i >> 1) & 1, false, false};
+		snprintf(config.name, sizeof(config.name), "%s sharded%s", config.bounded ? "bounded" : "hashed", config.margin ? " margin" : "");
+		struct isls2d sh;
+		pthread_t threads[TEST_THREADS];
+		struct test_worker workers[TEST_THREADS];
+		int failures = test_failures, capacity = TEST_THREADS * 64;
+		test_current = &config;
+		test_step = 0;
+		test_init(&sh, &config);
+		isls2d_shard(&sh, 16);
+		isls2d_reserve(&sh, capacity);
+		for (int t = 0; t < TEST_THREADS; t++) {
+			workers[t].sh = &sh;
+			workers[t].seed = 17 + t * 7919;
+			pthread_create(&threads[t], NULL, test_concurrent_thread, &workers[t]);
+		}
+		for (int t = 0; t < TEST_THREADS; t++) pthread_join(threads[t], NULL);
+		int live = 0;
+		for (int id = 0; id < capacity; id++) {
+			live += test_model[id].live;
+			test_check(test_model[id].live == (sh.entities[id].id == id), "live ids");
+		}
+		test_rects(&sh, NULL);
+		test_circles(&sh, NULL);
+		test_points(&sh);
+		test_rays(&sh);
+		test_knn(&sh);
+		test_pairs(&sh);
+		// Free list gives exactly the remaining reserved ids
+		int inserted = 0;
+		while (isls2d_insert_concurrent(&sh, 0, 0, 1, 1, NULL) >= 0) inserted++;
+		test_check(inserted == capacity - live, "reserved ids");
+		isls2d_clear(&sh);
+		if (test_failures == failures) printf("ok   %s\n", config.name);
+	}
+}
+
+struct test_reader {
+	const struct isls2d_snapshot *snap;
+	const struct isls2d_box *queries;
+	int *expected;
+	bool ok;
+};
+
+static void *test_snapshot_thread(void *arg) {
+	struct test_reader *reader = (struct test_reader *)arg;
+	int got[TEST_IDS];
+	for (int round = 0; round < 20; round++) {
+		for (int q = 0; q < 16; q++) {
+			const struct isls2d_box *b = &reader->queries[q];
+			int n = isls2d_snapshot_query_rect(reader->snap, b->x, b->y, b->width, b->height, ISLS2D_MASK_ALL, got, TEST_IDS);
+			qsort(got, n, sizeof(*got), test_compare_ints);
+			reader->ok = reader->ok && n == reader->expected[q] && memcmp(got, reader->expected + 16 + q * 64, (n < 64 ? n : 64) * sizeof(*got)) == 0;
+		}
+	}
+	return NULL;
+}
+
+// Readers query the snapshot while the grid keeps changing
+static void test_snapshot(void) {
+	static int expected[16 + 16 * 64];
+	static const struct test_config configs[] = {
+		{"hashed snapshot", false, false, false, false, false, false, true, false},
+		{"hierarchical snapshot", false, true, false, false, false, false, true, false},
+		{"rebuild snapshot", false, false, false, true, true, false, true, false},
+	};
+	for (int c = 0; c < 3; c++) {
+		struct isls2d sh;
+		struct isls2d_snapshot snap = {0};
+		struct isls2d_box queries[16];
+		pthread_t threads[TEST_THREADS];
+		struct test_reader readers[TEST_THREADS];
+		int failures = test_failures;
+		test_current = &configs[c];
+		test_seed = 7;
+		test_init(&sh, &configs[c]);
+		for (test_step = 0; test_step < 400; test_step++) test_change(&sh);
+		isls2d_snapshot_take(&sh, &snap);
+		for (int q = 0; q < 16; q++) {
+			int *ids = expected + 16 + q * 64, n = 0;
+			queries[q].x = test_rnd(-300, 300);
+			queries[q].y = test_rnd(-300, 300);
+			queries[q].width = queries[q].height = test_rnd(0, 80);
+			for (int id = 0; id < isls2d__arrlen(sh.entities); id++) {
+				const struct test_entity *e = &test_model[id];
+				if (e->live && isls2d_overlaps(queries[q].x, queries[q].y, queries[q].width, queries[q].height, e->x, e->y, e->width, e->height)) {
+					if (n < 64) ids[n] = id;
+					n++;
+				}
+			}
+			expected[q] = n;
+		}
+		for (int t = 0; t < TEST_THREADS; t++) {
+			struct test_reader reader = {&snap, queries, expected, true};
+			readers[t] = reader;
+			pthread_create(&threads[t], NULL, test_snapshot_thread, &readers[t]);
+		}
+		for (int i = 0; i < 400; i++) test_change(&sh);
+		for (int t = 0; t < TEST_THREADS; t++) {
+			pthread_join(threads[t], NULL);
+			test_check(readers[t].ok, "concurrent snapshot query");
+		}
+		isls2d_snapshot_clear(&snap);
+		isls2d_clear(&sh);
+		if (test_failures == failures) printf("ok   %s\n", configs[c].name);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (test_selected(argc, argv, "modes")) test_modes();
+	if (test_selected(argc, argv, "concurrent")) test_concurrent();
+	if (test_selected(argc, argv, "snapshot")) test_snapshot();
+	free(test_contacts);
+	printf("%d failures\n", test_failures);
+	return test_failures != 0;
+}
@@ -7,11 +7,9 @@
  * Do this:
  *   #define ISL_SPATIAL2D_IMPLEMENTATION
  * before you include this file in *one* C or C++ file to create the implementation.
- * Internally uses stb_ds.h for dynamic arrays and hash tables, so you also need:
- *   #define STB_DS_IMPLEMENTATION 
- * Probably in the future the good idea will be to include parts of stb_ds into this lib
- * directly or put here more basic implementation of hash tables and implement dynamic
- * arrays using realloc.
+ * Library has no dependencies besides C standard library, cells are stored in the
+ * built-in open addressing hash table (linear probing, power of two capacity, backward
+ * shift deletion, so no tombstones), dynamic arrays are implemented using realloc.
  *
  * QUICK NOTES:
  *   
@@ -23,13 +21,30 @@
  * Limitations:
  *   Key used in a spatial hash is plain int, because we store 2 coordinates in the same
  *   key the size limit is bounded to half size of int, i.e. if int is 32 bits, 
- *   coordinates (after dividing by cell size) are limited to [-65535, 65535] (16 bits).
+ *   coordinates (after dividing by cell size) are limited to [-32768, 32767] (16 bits).
+ *   Coordinates outside of this range wrap around, so distant cells share the same key,
+ *   which is still correct but slower. Define ISL_SPATIAL2D_KEY64 to use 64 bit keys
+ *   with 32 bits per coordinate, this costs a bit more memory per cell and a wider hash.
  *
  *
  * Initialization:
  *   struct isls2d sh;
  *   isls2d_init(&sh, 32.0f, 32.0f);
  *
+ * Initialization of bounded grid for worlds with known bounds, cells are stored in
+ * the flat array indexed directly by cell coordinates, so no hashing is done at all.
+ * Entities outside of the bounds are clamped into the border cells:
+ *   isls2d_init_bounded(&sh, 32.0f, 32.0f, world_x, world_y, world_width, world_height);
+ *
+ * Initialization of hierarchical grid for worlds mixing small and huge entities. Every
+ * next level has cells twice as large, entity is stored in the lowest level where its
+ * (fat) box isn't larger than the cell, so it's in at most 2x2 cells unless it's larger
+ * than cells of the top level. Queries, raycasts, kNN, pairs and contacts cover all
+ * levels, static entities are put into static cells of their level the same way.
+ * Hierarchy is hashed only, rebuild mode and concurrent changes aren't supported, batch
+ * update falls back to single updates:
+ *   isls2d_init_hierarchical(&sh, 8.0f, 8.0f, 8);
+ *
  * Deinit:
  *   isls2d_clear(&sh);
  *
@@ -42,10 +57,179 @@
  * Update entity:
  *   isls2d_update(&sh, id, new_x, new_y, new_width, new_height);  
  *
+ * Static entities (walls, terrain) are inserted separately and kept in their own compact
+ * sorted cells, which are rebuilt lazily only after static entities change, so cells of
+ * moving entities stay short. Static-static pairs are never reported nor tracked. Static
+ * entity can be updated and removed as usual, but it rebuilds all static cells, so it's
+ * meant to be rare, concurrent variants don't support static entities:
+ *   int wall = isls2d_insert_static(&sh, x, y, width, height, userdata);
+ *
+ * Idle entities can be put to sleep, sleeping entity stays in its cells and is found by
+ * queries, but its overlaps aren't recomputed (it keeps its current contacts) and pairs
+ * of two idle entities (sleeping or static) are neither reported nor tracked. Update
+ * which changes the box wakes the entity, update with the same box is skipped. In
+ * rebuild mode sleeping entities are still sorted into cells on rebuild:
+ *   isls2d_sleep(&sh, id);
+ *   isls2d_wake(&sh, id);
+ *
+ * Update many entities at once, new cell ranges are computed first, then all cell
+ * changes are grouped by cell, so each touched cell is looked up once per batch:
+ *   struct isls2d_box boxes[] = {{x1, y1, width1, height1}, {x2, y2, width2, height2}};
+ *   int ids[] = {id1, id2};
+ *   isls2d_update_batch(&sh, ids, boxes, 2);
+ *
+ * Fat cell ranges, set the margin right after initialization. Entity is bucketed into the
+ * cells of its box expanded by the margin and is re-bucketed only when its box leaves
+ * these cells, counters of re-buckets done and avoided are in sh.stats:
+ *   sh.margin = 4.0f;
+ *
+ * Loose grid for swarms of similarly sized entities not larger than cells, set the flag
+ * right after initialization. Entity is stored only in the cell of its center, so update
+ * moves it at most from one cell to another. Grid keeps the largest width and height of
+ * entities in sh.loose_width and sh.loose_height, queries, raycasts, kNN, pairs and
+ * contacts look into cells expanded by the half of them, so a few huge entities make all
+ * of it slower. Largest size shrinks lazily after the largest entity is removed or shrinks.
+ * Margin and hierarchy levels are ignored, concurrent variants don't support loose grid:
+ *   sh.loose = true;
+ *
+ * Rebuild mode for scenes where almost everything moves every tick, set the flag right
+ * after initialization. Insert, update and remove only store boxes, cells are rebuilt
+ * from scratch: (cell, id) pairs of all entities are radix sorted into one contiguous
+ * array with sorted cell keys and cell starts. Rebuild is done lazily by the first query,
+ * pair search or contacts drain after any change, or explicitly. Interleaving single
+ * changes with queries rebuilds every time, so batch changes together. Margin is ignored
+ * and contacts are tracked on rebuild:
+ *   sh.rebuild_mode = true;
+ *   isls2d_rebuild(&sh);
+ *
+ * Rebuild and pair finding can run on worker threads of your scheduler. Provide the
+ * parallel for callback which runs task(task_data, i) for every i in [0, count), possibly
+ * concurrently, and returns when all of them are done, and the number of tasks to split
+ * the work into (a few per thread balances better). Rebuild emits keys and radix sorts
+ * them in parallel, pair finding gives each task a disjoint range of cells and its own
+ * pairs buffer, buffers are concatenated in task order, so results don't depend on the
+ * scheduling. Contacts tracking and all other operations stay single threaded:
+ *   void parallel_for(isls2d_task_fn task, void *task_data, int count, void *udata) {...}
+ *   sh.parallel = parallel_for;
+ *   sh.parallel_udata = scheduler;
+ *   sh.tasks = 128;
+ *
+ * Concurrent insert, update and remove, call isls2d_shard right after initialization to
+ * split the cells into shards guarded by spin locks (hashed cells go to separate tables
+ * by key hash, bounded grid cells are striped by index) and reserve ids up front, since
+ * per-id arrays can't grow concurrently. Ids are taken from the lock-free free list,
+ * concurrent insert returns -1 when reserved ids are exhausted. Concurrent variants can
+ * run at the same time only with each other (and for different ids), contacts tracking
+ * and rebuild mode are not supported by them:
+ *   isls2d_shard(&sh, 64);
+ *   isls2d_reserve(&sh, 100000);
+ *   int id = isls2d_insert_concurrent(&sh, x, y, width, height, userdata);
+ *   isls2d_update_concurrent(&sh, id, new_x, new_y, new_width, new_height);
+ *   isls2d_remove_concurrent(&sh, id);
+ *
+ * Snapshot is an immutable query-only copy of the grid (boxes, userdata and compact
+ * sorted cells), queries on it don't write anything, so any number of threads can run
+ * them at the same time without locks, while the grid itself keeps changing. Snapshot
+ * of the hierarchical grid keeps entities in cells of their levels. Snapshot should be
+ * zero initialized before the first take, taking again reuses its memory:
+ *   struct isls2d_snapshot snap = {0};
+ *   isls2d_snapshot_take(&sh, &snap);
+ *   int count = isls2d_snapshot_query_rect(&snap, x, y, width, height, ISLS2D_MASK_ALL, ids, 64);
+ *   isls2d_snapshot_query_circle_each(&snap, x, y, radius, ISLS2D_MASK_ALL, on_entity, udata);
+ *   isls2d_snapshot_clear(&snap);
+ *
+ * Entities are stored as structure of arrays indexed by id, boxes are in sh.x, sh.y,
+ * sh.width, sh.height, cell ranges are in sh.ranges, collision filters are in
+ * sh.categories and sh.masks, userdata is in sh.entities:
+ *   isls2d_float right = sh.x[id] + sh.width[id];
+ *
+ * Query entities overlapping the rectangle, ids are written into the buffer, returns
+ * total count of overlapping entities (can be greater than buffer size):
+ *   int ids[64];
+ *   int count = isls2d_query_rect(&sh, x, y, width, height, ISLS2D_MASK_ALL, ids, 64);
+ *
+ * Query with a callback, return non-zero from the callback to stop the query:
+ *   int on_entity(int id, const void *data, void *udata) { ...; return 0; }
+ *   isls2d_query_rect_each(&sh, x, y, width, height, ISLS2D_MASK_ALL, on_entity, udata);
+ *
+ * Query entities closer than the radius to the point, only cells intersecting the
+ * circle are visited and candidates are tested by the exact circle-box distance:
+ *   int count = isls2d_query_circle(&sh, x, y, radius, ISLS2D_MASK_ALL, ids, 64);
+ *   isls2d_query_circle_each(&sh, x, y, radius, ISLS2D_MASK_ALL, on_entity, udata);
+ *
+ * Only check for any overlap (stops on the first one) or only count overlaps, nothing
+ * is written or called for found entities:
+ *   bool occupied = isls2d_query_rect_any(&sh, x, y, width, height, ISLS2D_MASK_ALL);
+ *   int density = isls2d_query_circle_count(&sh, x, y, radius, ISLS2D_MASK_ALL);
+ *
+ * Query entities containing the point (left and top borders of the box are inside,
+ * right and bottom are not), point lies in the single cell, so it's one lookup without
+ * dedup. Batched variant sorts points by cell, so points of the same cell share the
+ * lookup, callback gets the index of the point too:
+ *   int count = isls2d_query_point(&sh, x, y, ISLS2D_MASK_ALL, ids, 64);
+ *   int on_point(int point, int id, const void *data, void *udata) { ...; return 0; }
+ *   isls2d_query_points_each(&sh, points, points_count, ISLS2D_MASK_ALL, on_point, udata);
+ *
+ * Cast the ray from x, y along dx, dy up to max_t, hit point is x + t * dx, y + t * dy,
+ * so with the unit direction max_t is the length of the ray. Cells are walked in the ray
+ * order (DDA), each entity is tested once, up to max_hits closest hits are written sorted
+ * by t, traversal stops as soon as the remaining cells can't give closer hits, so with
+ * max_hits = 1 it is the first hit query. Walk also stops where the ray leaves the box of
+ * all entities (found by a scan of entities when the ray crosses more cells than there
+ * are entities), and on the bounded grid where it leaves the grid moving away from it,
+ * so max_t may be infinite, but the walk from the origin to the entities still takes a
+ * step per cell. Returns the number of hits written:
+ *   struct isls2d_hit hits[16];
+ *   int count = isls2d_raycast(&sh, x, y, dx, dy, max_t, ISLS2D_MASK_ALL, hits, 16);
+ *
+ * Query k entities nearest to the point (distance to the box, 0 inside of it) not
+ * farther than max_distance. Rings of cells around the point are searched outwards,
+ * search stops when the next ring can't be closer than the k-th best candidate, or is
+ * farther than max_distance, or when all occupied cells are seen. Neighbors are written
+ * sorted by distance, returns their count:
+ *   struct isls2d_neighbor neighbors[8];
+ *   int count = isls2d_query_knn(&sh, x, y, 8, max_distance, ISLS2D_MASK_ALL, neighbors);
+ *
+ * Collision filtering, every entity has the category bits and the mask of categories it
+ * collides with (both are all ones by default). Queries take the mask argument and find
+ * only entities with the category in it (ISLS2D_MASK_ALL finds all of them), pairs and
+ * contacts need each entity's category in the mask of the other one. Candidates are
+ * rejected by bits before their boxes are tested and cells keep OR of categories of
+ * their entities, so cells without matching categories are skipped entirely. Bits of
+ * entities which left the cell are dropped only when it empties or is rebuilt:
+ *   isls2d_set_filter(&sh, id, CATEGORY_UNIT, CATEGORY_WALL | CATEGORY_BULLET);
+ *   int count = isls2d_query_rect(&sh, x, y, width, height, CATEGORY_UNIT, ids, 64);
+ *
+ * Track overlaps incrementally, set the flag right after initialization. Insert, update
+ * and remove record "pair began" and "pair ended" events (pair.a < pair.b), which are
+ * drained once per tick, drained arrays stay valid until the next drain. Only net changes
+ * since the previous drain are reported, sorted by pairs: pair which began and ended (or
+ * ended and began again) between two drains isn't reported at all, so applying drained
+ * arrays to the previous contacts gives the current ones. Ids of removed entities are
+ * reused only after the next drain, so drained pairs never mix up two entities:
+ *   sh.track_overlap = true;
+ *   struct isls2d_contacts contacts = isls2d_drain_contacts(&sh);
+ *   for (int i = 0; i < contacts.began_count; i++) on_begin(contacts.began[i]);
+ *   for (int i = 0; i < contacts.ended_count; i++) on_end(contacts.ended[i]);
+ * Current overlaps of the entity are in the sorted array sh.entities[id].overlaps.
+ *
+ * Find all overlapping pairs in one pass over occupied cells, each pair is reported
+ * once (pair.a < pair.b) by the lowest cell shared by both entities (in loose grid cells
+ * are paired with their neighbors instead). Pairs buffer is owned by sh and stays valid
+ * until the next call:
+ *   const struct isls2d_pair *pairs;
+ *   int count = isls2d_find_pairs(&sh, &pairs);
+ *
  *
  * Additional compilation defines:
  *   ISL_SPATIAL2D_STATIC - static compilation
  *   ISL_SPATIAL2D_DOUBLE - use doubles instead of floats
+ *   ISL_SPATIAL2D_KEY64 - use 64 bit cell keys (32 bits per coordinate)
+ *   ISL_SPATIAL2D_MASK64 - use 64 bit categories and masks instead of 32 bit ones
+ *   ISL_SPATIAL2D_NO_SIMD - don't use SSE/AVX2 kernels for overlap tests, by default they
+ *     are picked at compile time (i.e. compile with -mavx2 to get AVX2), doubles always
+ *     use scalar code
+ *   ISLS2D_REALLOC, ISLS2D_FREE - custom allocator, default is realloc and free
  *
  * LICENSE
  *
@@ -53,7 +237,9 @@
  *
  */
 
-#include "stb_ds.h"
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
 
 #ifndef ISLS2D_DEF
 #ifdef ISL_SPATIAL2D_STATIC
@@ -63,53 +249,226 @@
 #endif
 #endif
 
-#define ISLS2D_XMULT (1 << (4*sizeof(int)))
-#define ISLS2D_KEY(x, y) ((x)*ISLS2D_XMULT + (y))
-#define ISLS2D_X(key) ((x)/ISLS2D_XMULT)
-#define ISLS2D_Y(key) ((y)%ISLS2D_XMULT)
+#ifndef ISL_SPATIAL2D_KEY64
+#define isls2d_key    int
+#define isls2d__ukey  unsigned
+#define ISLS2D_KEY_BITS 16
+#else
+#define isls2d_key    long long
+#define isls2d__ukey  unsigned long long
+#define ISLS2D_KEY_BITS 32
+#endif
+
+// Coordinates are packed as two's complement halves, so negative coordinates don't alias
+#define ISLS2D_KEY_MASK (((isls2d__ukey)1 << ISLS2D_KEY_BITS) - 1)
+#define ISLS2D_KEY_SIGN ((isls2d__ukey)1 << (ISLS2D_KEY_BITS - 1))
+#define ISLS2D_KEY(x, y) ((isls2d_key)(((isls2d__ukey)(x) << ISLS2D_KEY_BITS) | ((isls2d__ukey)(y) & ISLS2D_KEY_MASK)))
+#define ISLS2D_X(key) ((int)((key) >> ISLS2D_KEY_BITS))
+#define ISLS2D_Y(key) ((int)((((isls2d__ukey)(key) & ISLS2D_KEY_MASK) ^ ISLS2D_KEY_SIGN) - ISLS2D_KEY_SIGN))
+
+#ifndef ISL_SPATIAL2D_MASK64
+#define isls2d_mask   unsigned
+#else
+#define isls2d_mask   unsigned long long
+#endif
+
+#define ISLS2D_MASK_ALL ((isls2d_mask)~(isls2d_mask)0)
 
 #ifndef ISL_SPATIAL2D_DOUBLE
 #define isls2d_float  float
 #define isls2d__floor floorf
 #define isls2d__ceil  ceilf
+#define isls2d__sqrt  sqrtf
 #else
 #define isls2d_float  double
 #define isls2d__floor floor
 #define isls2d__ceil  ceil
+#define isls2d__sqrt  sqrt
 #endif
 
+// Hot data (boxes, cell ranges, query stamps) is stored separately in the arrays of
+// struct isls2d indexed by id, entity keeps only rarely accessed data
 struct isls2d_entity {
 	int id;
-	isls2d_float x;
-	isls2d_float y;
-	isls2d_float width;
-	isls2d_float height;
+	const void *data;
+	int *overlaps;
+};
+
+struct isls2d_range {
 	int xmin;
 	int xmax;
 	int ymin;
 	int ymax;
-	const void *data;
-	struct {int key; bool value;} *overlaps;
+	int level;
+};
+
+struct isls2d_box {
+	isls2d_float x;
+	isls2d_float y;
+	isls2d_float width;
+	isls2d_float height;
+};
+
+struct isls2d__batch_op;
+struct isls2d__point_op;
+struct isls2d__flat_entry;
+
+struct isls2d_pair {
+	int a;
+	int b;
+};
+
+struct isls2d_point {
+	isls2d_float x;
+	isls2d_float y;
+};
+
+struct isls2d_hit {
+	int id;
+	isls2d_float t;
+};
+
+struct isls2d_neighbor {
+	int id;
+	isls2d_float distance;
+};
+
+struct isls2d_contacts {
+	const struct isls2d_pair *began;
+	int began_count;
+	const struct isls2d_pair *ended;
+	int ended_count;
+};
+
+struct isls2d_stats {
+	unsigned long long rebuckets;
+	unsigned long long rebuckets_avoided;
+};
+
+struct isls2d_cell {
+	isls2d_key key;
+	int *ids;
+	isls2d_mask categories;
 };
 
+typedef void (*isls2d_task_fn)(void *task_data, int index);
+typedef void (*isls2d_parallel_fn)(isls2d_task_fn task, void *task_data, int count, void *udata);
+
 struct isls2d {
-	struct {int key; int *value;} *cells;
+	struct isls2d_cell *cells;
+	int cells_count;
+	int cells_capacity;
+	int grid_x;
+	int grid_y;
+	int grid_width;
+	int grid_height;
 	struct isls2d_entity *entities;
+	isls2d_float *x;
+	isls2d_float *y;
+	isls2d_float *width;
+	isls2d_float *height;
+	struct isls2d_range *ranges;
+	unsigned *query_stamps;
+	isls2d_mask *categories;
+	isls2d_mask *masks;
+	unsigned char *flags;
 	int *reusable_ids;
+	unsigned long long reusable_head;
+	int *removed_ids;
+	unsigned query_epoch;
+	struct isls2d_pair *pairs;
+	struct isls2d_pair *began;
+	struct isls2d_pair *ended;
+	struct isls2d_pair *drained_began;
+	struct isls2d_pair *drained_ended;
+	int *overlaps_scratch;
+	struct isls2d__batch_op *batch_ops;
+	struct isls2d__point_op *point_ops;
+	struct isls2d__flat_entry *flat_entries;
+	struct isls2d__flat_entry *flat_scratch;
+	isls2d_key *flat_keys;
+	int *flat_starts;
+	int *flat_ids;
+	isls2d_mask *flat_categories;
+	struct isls2d__flat_entry *static_entries;
+	isls2d_key *static_keys;
+	int *static_starts;
+	int *static_ids;
+	isls2d_mask *static_categories;
+	isls2d_parallel_fn parallel;
+	void *parallel_udata;
+	int tasks;
+	int *task_counts;
+	struct isls2d_pair **task_pairs;
+	struct isls2d *shards;
+	struct isls2d *levels;
+	int levels_count;
+	int *locks;
+	int locks_count;
 	isls2d_float inv_cell_width;
 	isls2d_float inv_cell_height;
+	isls2d_float margin;
+	isls2d_float loose_width;
+	isls2d_float loose_height;
+	struct isls2d_stats stats;
 	bool track_overlap;
+	bool rebuild_mode;
+	bool loose;
+	bool flat_dirty;
+	bool static_dirty;
+	bool loose_dirty;
 };
 
+struct isls2d_snapshot {
+	struct isls2d frozen;
+};
+
+typedef int (*isls2d_query_fn)(int id, const void *data, void *udata);
+typedef int (*isls2d_point_query_fn)(int point, int id, const void *data, void *udata);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 ISLS2D_DEF void isls2d_init(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height);
+ISLS2D_DEF void isls2d_init_bounded(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+ISLS2D_DEF void isls2d_init_hierarchical(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height, int levels);
 ISLS2D_DEF void isls2d_clear(struct isls2d *sh);
 ISLS2D_DEF int isls2d_insert(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data);
+ISLS2D_DEF int isls2d_insert_static(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data);
 ISLS2D_DEF void isls2d_remove(struct isls2d *sh, int id);
 ISLS2D_DEF void isls2d_update(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+ISLS2D_DEF void isls2d_update_batch(struct isls2d *sh, const int *ids, const struct isls2d_box *boxes, int n);
+ISLS2D_DEF void isls2d_sleep(struct isls2d *sh, int id);
+ISLS2D_DEF void isls2d_wake(struct isls2d *sh, int id);
+ISLS2D_DEF void isls2d_set_filter(struct isls2d *sh, int id, isls2d_mask category, isls2d_mask mask);
+ISLS2D_DEF void isls2d_rebuild(struct isls2d *sh);
+ISLS2D_DEF void isls2d_reserve(struct isls2d *sh, int capacity);
+ISLS2D_DEF void isls2d_shard(struct isls2d *sh, int shards);
+ISLS2D_DEF int isls2d_insert_concurrent(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data);
+ISLS2D_DEF void isls2d_remove_concurrent(struct isls2d *sh, int id);
+ISLS2D_DEF void isls2d_update_concurrent(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+ISLS2D_DEF int isls2d_query_rect(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, int *ids, int max_ids);
+ISLS2D_DEF int isls2d_query_rect_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, isls2d_query_fn fn, void *udata);
+ISLS2D_DEF int isls2d_query_circle(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, int *ids, int max_ids);
+ISLS2D_DEF int isls2d_query_circle_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata);
+ISLS2D_DEF bool isls2d_query_rect_any(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask);
+ISLS2D_DEF int isls2d_query_rect_count(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask);
+ISLS2D_DEF bool isls2d_query_circle_any(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask);
+ISLS2D_DEF int isls2d_query_circle_count(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask);
+ISLS2D_DEF int isls2d_query_point(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_mask mask, int *ids, int max_ids);
+ISLS2D_DEF int isls2d_query_point_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_mask mask, isls2d_query_fn fn, void *udata);
+ISLS2D_DEF int isls2d_query_points_each(struct isls2d *sh, const struct isls2d_point *points, int n, isls2d_mask mask, isls2d_point_query_fn fn, void *udata);
+ISLS2D_DEF int isls2d_raycast(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float dx, isls2d_float dy, isls2d_float max_t, isls2d_mask mask, struct isls2d_hit *hits, int max_hits);
+ISLS2D_DEF int isls2d_query_knn(struct isls2d *sh, isls2d_float x, isls2d_float y, int k, isls2d_float max_distance, isls2d_mask mask, struct isls2d_neighbor *neighbors);
+ISLS2D_DEF int isls2d_find_pairs(struct isls2d *sh, const struct isls2d_pair **pairs);
+ISLS2D_DEF struct isls2d_contacts isls2d_drain_contacts(struct isls2d *sh);
+ISLS2D_DEF void isls2d_snapshot_take(struct isls2d *sh, struct isls2d_snapshot *snap);
+ISLS2D_DEF void isls2d_snapshot_clear(struct isls2d_snapshot *snap);
+ISLS2D_DEF int isls2d_snapshot_query_rect(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, int *ids, int max_ids);
+ISLS2D_DEF int isls2d_snapshot_query_rect_each(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, isls2d_query_fn fn, void *udata);
+ISLS2D_DEF int isls2d_snapshot_query_circle(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, int *ids, int max_ids);
+ISLS2D_DEF int isls2d_snapshot_query_circle_each(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata);
 #define isls2d_overlaps(x1,y1,w1,h1,x2,y2,w2,h2) ((x1)+(w1)>(x2)&&(x2)+(w2)>(x1)&&(y1)+(h1)>(y2)&&(y2)+(h2)>(y1))
 
 #ifdef __cplusplus
@@ -125,32 +484,203 @@ ISLS2D_DEF void isls2d_update(struct isls2d *sh, int id, isls2d_float x, isls2d_
 #endif // ISL_SPATIAL2D_IMPLEMENTATION_ONCE
 
 #include <math.h>
+#include <string.h>
+
+#ifndef ISLS2D_REALLOC
+#include <stdlib.h>
+#define ISLS2D_REALLOC(p, size) realloc((p), (size))
+#define ISLS2D_FREE(p) free(p)
+#endif
+
+#ifdef __cplusplus
+#define isls2d__arrcast(a) (decltype(a))
+#else
+#define isls2d__arrcast(a)
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define ISLS2D__MSVC_ATOMICS
+#endif
+
+#if !defined(ISL_SPATIAL2D_NO_SIMD) && !defined(ISL_SPATIAL2D_DOUBLE) && defined(__AVX2__)
+#include <immintrin.h>
+#define ISLS2D__AVX2
+#define ISLS2D__LANES 8
+#elif !defined(ISL_SPATIAL2D_NO_SIMD) && !defined(ISL_SPATIAL2D_DOUBLE) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define ISLS2D__SSE2
+#define ISLS2D__LANES 4
+#else
+#define ISLS2D__LANES 8
+#endif
+
+#define ISLS2D__CELLS_MIN_CAPACITY 16
+
+#define ISLS2D__STATIC   1
+#define ISLS2D__SLEEPING 2
+#define ISLS2D__IDLE     (ISLS2D__STATIC | ISLS2D__SLEEPING)
 
+struct isls2d__arrheader {
+	int length;
+	int capacity;
+};
+
+#define isls2d__arrheader(a)     ((struct isls2d__arrheader *)(a) - 1)
+#define isls2d__arrlen(a)        ((a) ? isls2d__arrheader(a)->length : 0)
+#define isls2d__arrcap(a)        ((a) ? isls2d__arrheader(a)->capacity : 0)
+#define isls2d__arrreserve(a, n) ((n) > isls2d__arrcap(a) ? ((a) = isls2d__arrcast(a) isls2d__arrgrow((a), sizeof(*(a)), (n)), 0) : 0)
+#define isls2d__arrsetlen(a, n)  (isls2d__arrreserve(a, n), (a) ? isls2d__arrheader(a)->length = (n) : 0)
+#define isls2d__arrput(a, v)     (isls2d__arrreserve(a, isls2d__arrlen(a) + 1), (a)[isls2d__arrheader(a)->length++] = (v))
+#define isls2d__arrpop(a)        ((a)[--isls2d__arrheader(a)->length])
+#define isls2d__arrins(a, i, v)  (isls2d__arrreserve(a, isls2d__arrlen(a) + 1), memmove(&(a)[(i)+1], &(a)[i], sizeof(*(a)) * (isls2d__arrheader(a)->length++ - (i))), (a)[i] = (v))
+#define isls2d__arrdel(a, i)     (memmove(&(a)[i], &(a)[(i)+1], sizeof(*(a)) * (--isls2d__arrheader(a)->length - (i))))
+#define isls2d__arrdelswap(a, i) ((a)[i] = (a)[--isls2d__arrheader(a)->length])
+#define isls2d__arrfree(a)       ((a) ? ISLS2D_FREE(isls2d__arrheader(a)) : (void)0, (a) = NULL)
+
+struct isls2d__batch_op {
+	isls2d_key key;
+	int x;
+	int y;
+	int id;
+	int seq;
+	bool insert;
+};
+
+struct isls2d__point_op {
+	isls2d_key key;
+	int x;
+	int y;
+	int index;
+};
+
+struct isls2d__flat_entry {
+	isls2d_key key;
+	int id;
+};
+
+struct isls2d__job {
+	struct isls2d *sh;
+	int tasks;
+	int shift;
+};
+
+struct isls2d__query_buffer {
+	int *ids;
+	int max_ids;
+	int count;
+};
+
+static void *isls2d__arrgrow(void *a, size_t item_size, int min_capacity);
 static int *isls2d__arrsorted_put_if_absent(int *a, int v);
 static int *isls2d__arrsorted_del(int *a, int v);
-static void isls2d__insert_entity_into_cells(struct isls2d *sh, struct isls2d_entity *e);
-static void isls2d__remove_entity_from_cells(struct isls2d *sh, struct isls2d_entity *e);
+static unsigned isls2d__hash(isls2d_key key);
+static struct isls2d_cell *isls2d__cell_get(const struct isls2d *sh, int x, int y);
+static struct isls2d_cell *isls2d__cell_put(struct isls2d *sh, int x, int y);
+static void isls2d__cell_del(struct isls2d *sh, struct isls2d_cell *cell);
+static const int *isls2d__cell_ids(const struct isls2d *sh, int x, int y, bool statics, int *n, isls2d_mask *categories);
+static void isls2d__cell_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax);
+static void isls2d__entity_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax);
+static void isls2d__query_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax);
+static void isls2d__loose_extent(struct isls2d *sh, isls2d_float old_width, isls2d_float old_height, isls2d_float width, isls2d_float height);
+static void isls2d__loose_shrink(struct isls2d *sh);
+static unsigned isls2d__overlap_mask(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const int *ids, int n);
+static unsigned isls2d__category_mask(const struct isls2d *sh, isls2d_mask mask, const int *ids, int n);
+static unsigned isls2d__pair_mask(const struct isls2d *sh, int id, const int *ids, int n);
+static struct isls2d *isls2d__level(const struct isls2d *sh, int level);
+static int isls2d__pick_level(const struct isls2d *sh, isls2d_float width, isls2d_float height);
+static void isls2d__fat_range(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, struct isls2d_range *r);
+static unsigned long long isls2d__atomic_load64(unsigned long long *p);
+static bool isls2d__atomic_cas64(unsigned long long *p, unsigned long long expected, unsigned long long desired);
+static void isls2d__atomic_add64(unsigned long long *p, unsigned long long v);
+static int isls2d__atomic_load32(int *p);
+static void isls2d__atomic_store32(int *p, int v);
+static void isls2d__lock(int *lock);
+static void isls2d__unlock(int *lock);
+static int isls2d__shard_index(const struct isls2d *sh, isls2d_key key);
+static int *isls2d__cell_lock(struct isls2d *sh, int x, int y);
+static void isls2d__push_id(struct isls2d *sh, int id);
+static int isls2d__pop_id(struct isls2d *sh);
+static void isls2d__resize_ids(struct isls2d *sh, int n);
+static int isls2d__alloc_id(struct isls2d *sh);
+static void isls2d__insert_entity_into_cells(struct isls2d *sh, int id, bool locked);
+static void isls2d__remove_entity_from_cells(struct isls2d *sh, int id, struct isls2d_range r, bool locked);
+static void isls2d__contact(struct isls2d_pair **events, int a, int b);
+static int isls2d__compare_ints(const void *a, const void *b);
+static int isls2d__compare_pairs(const void *a, const void *b);
+static void isls2d__net_contacts(struct isls2d_pair *began, struct isls2d_pair *ended);
+static void isls2d__track_overlaps(struct isls2d *sh, int id);
+static bool isls2d__touch(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+static bool isls2d__update_range(struct isls2d *sh, struct isls2d_stats *stats, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+static void isls2d__batch_emit(struct isls2d *sh, int id, struct isls2d_range from, struct isls2d_range except, bool insert);
+static int isls2d__compare_batch_ops(const void *a, const void *b);
+static void isls2d__run(struct isls2d *sh, isls2d_task_fn task, struct isls2d__job *job);
+static void isls2d__chunk(int n, int tasks, int index, int *begin, int *end);
+static void isls2d__rebuild_count_task(void *task_data, int index);
+static void isls2d__rebuild_emit_task(void *task_data, int index);
+static void isls2d__radix_count_task(void *task_data, int index);
+static void isls2d__radix_scatter_task(void *task_data, int index);
+static void isls2d__cells_count_task(void *task_data, int index);
+static void isls2d__cells_emit_task(void *task_data, int index);
+static void isls2d__pairs_task(void *task_data, int index);
+static int isls2d__prefix_sum(struct isls2d *sh, int tasks);
+static void *isls2d__arrcopy(void *a, const void *b, size_t item_size);
+static bool isls2d__circle_overlaps(isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_float bx, isls2d_float by, isls2d_float bwidth, isls2d_float bheight);
+static bool isls2d__circle_span(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, int cy, int xmin, int xmax, int *from, int *to);
+static int isls2d__query(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_float radius, isls2d_mask mask, bool any, isls2d_query_fn fn, void *udata);
+static void isls2d__heap_down(struct isls2d_neighbor *heap, int n, int i);
+static isls2d_float isls2d__ray_extent(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float inv_dx, isls2d_float inv_dy, isls2d_float dx, isls2d_float dy, isls2d_float max_t);
+static void isls2d__knn_ids(struct isls2d *sh, isls2d_float x, isls2d_float y, const int *cell_ids, int n, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count);
+static int isls2d__knn_cell(struct isls2d *sh, const struct isls2d *grid, isls2d_float x, isls2d_float y, int cx, int cy, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count);
+static void isls2d__knn_scan(struct isls2d *sh, const struct isls2d *grid, isls2d_float x, isls2d_float y, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count);
+static int isls2d__compare_neighbors(const void *a, const void *b);
+static void isls2d__point_cell(const struct isls2d *sh, isls2d_float x, isls2d_float y, int *cx, int *cy);
+static int isls2d__compare_point_ops(const void *a, const void *b);
+static void isls2d__snapshot_level(const struct isls2d *grid, struct isls2d *frozen);
+static int isls2d__snapshot_query(const struct isls2d *frozen, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata);
+static void isls2d__key_cell(const struct isls2d *sh, isls2d_key key, int *cx, int *cy);
+static void isls2d__cell_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int level, int cx, int cy, const int *cell_ids, int n);
+static void isls2d__entity_pairs(struct isls2d *sh, struct isls2d_pair **pairs, isls2d_key key, int a, struct isls2d_range ra, const int *cell_ids, int n);
+static void isls2d__level_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int id);
+static void isls2d__loose_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int cx, int cy, const int *cell_ids, int n);
+static void isls2d__update_static(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height);
+static int isls2d__compare_flat_entries(const void *a, const void *b);
+static void isls2d__sort_cells(const struct isls2d *sh, struct isls2d__flat_entry *entries, isls2d_key **keys, int **starts, int **ids, isls2d_mask **categories);
+static void isls2d__build_statics(struct isls2d *sh);
+static void isls2d__refresh(struct isls2d *sh);
+static int isls2d__query_buffer_put(int id, const void *data, void *udata);
+static unsigned isls2d__query_begin(struct isls2d *sh);
+
 
+void *isls2d__arrgrow(void *a, size_t item_size, int min_capacity) {
+	int length = isls2d__arrlen(a), capacity = 2 * isls2d__arrcap(a);
+	if (capacity < min_capacity) capacity = min_capacity;
+	if (capacity < 4) capacity = 4;
+	struct isls2d__arrheader *header = (struct isls2d__arrheader *)ISLS2D_REALLOC(a ? isls2d__arrheader(a) : NULL, sizeof(*header) + item_size * capacity);
+	header->length = length;
+	header->capacity = capacity;
+	return header + 1;
+}
 
 int *isls2d__arrsorted_put_if_absent(int *a, int v) {
-	int n = arrlen(a), l = 0, r = n - 1, m = (l + r) >> 1;
+	int n = isls2d__arrlen(a), l = 0, r = n - 1, m = (l + r) >> 1;
 	while (l <= r) {
 		if (a[m] < v)      l = m + 1;
 		else if (a[m] > v) r = m - 1;
 		else return a;
 		m = (l + r) >> 1;
 	}
-	arrins(a, l, v);
+	isls2d__arrins(a, l, v);
 	return a;
 }
 
 int *isls2d__arrsorted_del(int *a, int v) {
-	int n = arrlen(a), l = 0, r = n - 1, m = (l + r) >> 1;
+	int n = isls2d__arrlen(a), l = 0, r = n - 1, m = (l + r) >> 1;
 	while (l <= r) {
 		if (a[m] < v)      l = m + 1;
 		else if (a[m] > v) r = m - 1;
 		else {
-			arrdel(a, m);
+			isls2d__arrdel(a, m);
 			return a;
 		}
 		m = (l + r) >> 1;
@@ -158,132 +688,1936 @@ int *isls2d__arrsorted_del(int *a, int v) {
 	return a;
 }
 
-void isls2d__insert_entity_into_cells(struct isls2d *sh, struct isls2d_entity *e) {
-	int id = e->id, xmin = e->xmin, xmax = e->xmax, ymin = e->ymin, ymax = e->ymax;
-	for (int x = e->xmin; x < xmax; x++) {
-		for (int y = ymin; y < ymax; y++) {
-			int key = ISLS2D_KEY(x, y);
-			int *cell_ids = hmget(sh->cells, key);
-			int n = arrlen(cell_ids);
-			if (track_overlap) {
+unsigned isls2d__hash(isls2d_key key) {
+#ifndef ISL_SPATIAL2D_KEY64
+	unsigned h = (unsigned)key;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+#else
+	unsigned long long h = (unsigned long long)key;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return (unsigned)h;
+#endif
+}
+
+struct isls2d_cell *isls2d__cell_get(const struct isls2d *sh, int x, int y) {
+	if (sh->grid_width) return &sh->cells[(y - sh->grid_y) * sh->grid_width + (x - sh->grid_x)];
+	// Sharded cells live in the tables of shards, which are grids used only for cells
+	if (sh->shards) sh = &sh->shards[isls2d__shard_index(sh, ISLS2D_KEY(x, y))];
+	if (sh->cells_count == 0) return NULL;
+	isls2d_key key = ISLS2D_KEY(x, y);
+	unsigned mask = (unsigned)sh->cells_capacity - 1;
+	for (unsigned i = isls2d__hash(key) & mask;; i = (i + 1) & mask) {
+		struct isls2d_cell *cell = &sh->cells[i];
+		if (cell->ids == NULL) return NULL;
+		if (cell->key == key) return cell;
+	}
+}
+
+struct isls2d_cell *isls2d__cell_put(struct isls2d *sh, int x, int y) {
+	struct isls2d_cell *cell = isls2d__cell_get(sh, x, y);
+	if (cell) return cell;
+	isls2d_key key = ISLS2D_KEY(x, y);
+	if (sh->shards) sh = &sh->shards[isls2d__shard_index(sh, key)];
+	if (2 * (sh->cells_count + 1) > sh->cells_capacity) {
+		struct isls2d_cell *cells = sh->cells;
+		int capacity = sh->cells_capacity;
+		sh->cells_capacity = capacity ? 2 * capacity : ISLS2D__CELLS_MIN_CAPACITY;
+		sh->cells = (struct isls2d_cell *)ISLS2D_REALLOC(NULL, sh->cells_capacity * sizeof(*sh->cells));
+		memset(sh->cells, 0, sh->cells_capacity * sizeof(*sh->cells));
+		unsigned mask = (unsigned)sh->cells_capacity - 1;
+		for (int j = 0; j < capacity; j++) {
+			if (cells[j].ids == NULL) continue;
+			unsigned i = isls2d__hash(cells[j].key) & mask;
+			while (sh->cells[i].ids != NULL) i = (i + 1) & mask;
+			sh->cells[i] = cells[j];
+		}
+		ISLS2D_FREE(cells);
+	}
+	unsigned mask = (unsigned)sh->cells_capacity - 1;
+	unsigned i = isls2d__hash(key) & mask;
+	while (sh->cells[i].ids != NULL) i = (i + 1) & mask;
+	cell = &sh->cells[i];
+	cell->key = key;
+	cell->categories = 0;
+	// Non-NULL ids marks the slot as occupied
+	isls2d__arrreserve(cell->ids, 4);
+	sh->cells_count++;
+	return cell;
+}
+
+void isls2d__cell_del(struct isls2d *sh, struct isls2d_cell *cell) {
+	// Bounded grid cells are never deleted, empty arrays are kept for reuse, categories
+	// aren't recomputed on every removal, stale bits are dropped once the cell is empty
+	if (sh->grid_width) {
+		cell->categories = 0;
+		return;
+	}
+	if (sh->shards) sh = &sh->shards[isls2d__shard_index(sh, cell->key)];
+	unsigned mask = (unsigned)sh->cells_capacity - 1;
+	unsigned i = (unsigned)(cell - sh->cells);
+	isls2d__arrfree(cell->ids);
+	// Backward shift deletion: move following entries of the probe chain into the hole
+	// unless their home slot lies cyclically in (hole, current]
+	for (unsigned j = (i + 1) & mask; sh->cells[j].ids != NULL; j = (j + 1) & mask) {
+		unsigned home = isls2d__hash(sh->cells[j].key) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			sh->cells[i] = sh->cells[j];
+			sh->cells[j].ids = NULL;
+			i = j;
+		}
+	}
+	sh->cells_count--;
+}
+
+// Ids of the cell, in rebuild mode and in the static partition cell is found by the binary
+// search in sorted keys, categories get OR of categories of the cell entities when requested
+const int *isls2d__cell_ids(const struct isls2d *sh, int x, int y, bool statics, int *n, isls2d_mask *categories) {
+	*n = 0;
+	if (categories) *categories = 0;
+	if (statics || sh->rebuild_mode) {
+		const isls2d_key *keys = statics ? sh->static_keys : sh->flat_keys;
+		const int *starts = statics ? sh->static_starts : sh->flat_starts;
+		isls2d__ukey key = (isls2d__ukey)ISLS2D_KEY(x, y);
+		int l = 0, r = isls2d__arrlen(keys) - 1;
+		while (l <= r) {
+			int m = (l + r) >> 1;
+			isls2d__ukey k = (isls2d__ukey)keys[m];
+			if (k < key)      l = m + 1;
+			else if (k > key) r = m - 1;
+			else {
+				*n = starts[m + 1] - starts[m];
+				if (categories) *categories = statics ? sh->static_categories[m] : sh->flat_categories[m];
+				return (statics ? sh->static_ids : sh->flat_ids) + starts[m];
+			}
+		}
+		return NULL;
+	}
+	struct isls2d_cell *cell = isls2d__cell_get(sh, x, y);
+	if (cell == NULL) return NULL;
+	*n = isls2d__arrlen(cell->ids);
+	if (categories) *categories = cell->categories;
+	return cell->ids;
+}
+
+void isls2d__cell_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax) {
+	*xmin = isls2d__floor(x * sh->inv_cell_width);
+	*xmax = isls2d__ceil((x + width) * sh->inv_cell_width);
+	*ymin = isls2d__floor(y * sh->inv_cell_height);
+	*ymax = isls2d__ceil((y + height) * sh->inv_cell_height);
+	// Degenerate boxes lying exactly on the cell border still belong to one cell
+	if (*xmax <= *xmin) *xmax = *xmin + 1;
+	if (*ymax <= *ymin) *ymax = *ymin + 1;
+	if (sh->grid_width) {
+		int gxmax = sh->grid_x + sh->grid_width, gymax = sh->grid_y + sh->grid_height;
+		if (*xmin < sh->grid_x) *xmin = sh->grid_x; else if (*xmin >= gxmax) *xmin = gxmax - 1;
+		if (*ymin < sh->grid_y) *ymin = sh->grid_y; else if (*ymin >= gymax) *ymin = gymax - 1;
+		if (*xmax <= *xmin) *xmax = *xmin + 1; else if (*xmax > gxmax) *xmax = gxmax;
+		if (*ymax <= *ymin) *ymax = *ymin + 1; else if (*ymax > gymax) *ymax = gymax;
+	}
+}
+
+// Cells the entity is bucketed into, loose grid keeps it only in the cell of its center
+void isls2d__entity_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax) {
+	if (!sh->loose) {
+		isls2d__cell_range(sh, x, y, width, height, xmin, xmax, ymin, ymax);
+		return;
+	}
+	isls2d__point_cell(sh, x + 0.5f * width, y + 0.5f * height, xmin, ymin);
+	*xmax = *xmin + 1;
+	*ymax = *ymin + 1;
+}
+
+// Cells holding entities which can overlap the box, in loose grid the center of such
+// entity is at most half of the largest size away, far borders are inclusive since the
+// center can lie exactly on them
+void isls2d__query_range(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, int *xmin, int *xmax, int *ymin, int *ymax) {
+	if (!sh->loose) {
+		isls2d__cell_range(sh, x, y, width, height, xmin, xmax, ymin, ymax);
+		return;
+	}
+	isls2d_float ex = 0.5f * sh->loose_width, ey = 0.5f * sh->loose_height;
+	isls2d__point_cell(sh, x - ex, y - ey, xmin, ymin);
+	isls2d__point_cell(sh, x + width + ex, y + height + ey, xmax, ymax);
+	++*xmax;
+	++*ymax;
+}
+
+// Largest size grows right away, but when the entity which may be the largest shrinks
+// or leaves it's recomputed lazily on refresh
+void isls2d__loose_extent(struct isls2d *sh, isls2d_float old_width, isls2d_float old_height, isls2d_float width, isls2d_float height) {
+	if (!sh->loose) return;
+	if ((old_width > width && old_width >= sh->loose_width) || (old_height > height && old_height >= sh->loose_height)) sh->loose_dirty = true;
+	if (width > sh->loose_width) sh->loose_width = width;
+	if (height > sh->loose_height) sh->loose_height = height;
+}
+
+void isls2d__loose_shrink(struct isls2d *sh) {
+	int n = isls2d__arrlen(sh->entities);
+	sh->loose_width = sh->loose_height = 0;
+	for (int id = 0; id < n; id++) {
+		if (sh->entities[id].id != id) continue;
+		if (sh->width[id] > sh->loose_width) sh->loose_width = sh->width[id];
+		if (sh->height[id] > sh->loose_height) sh->loose_height = sh->height[id];
+	}
+	sh->loose_dirty = false;
+}
+
+// Tests the box against up to ISLS2D__LANES candidates at once, returns the bitmask of
+// overlapping ones, bit i is set when ids[i] overlaps
+unsigned isls2d__overlap_mask(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const int *ids, int n) {
+#if defined(ISLS2D__AVX2)
+	if (n == 8) {
+		__m256i idx = _mm256_loadu_si256((const __m256i *)ids);
+		__m256 ox = _mm256_i32gather_ps(sh->x, idx, 4), oy = _mm256_i32gather_ps(sh->y, idx, 4);
+		__m256 ox2 = _mm256_add_ps(ox, _mm256_i32gather_ps(sh->width, idx, 4));
+		__m256 oy2 = _mm256_add_ps(oy, _mm256_i32gather_ps(sh->height, idx, 4));
+		__m256 hx = _mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(x + width), ox, _CMP_GT_OQ), _mm256_cmp_ps(ox2, _mm256_set1_ps(x), _CMP_GT_OQ));
+		__m256 hy = _mm256_and_ps(_mm256_cmp_ps(_mm256_set1_ps(y + height), oy, _CMP_GT_OQ), _mm256_cmp_ps(oy2, _mm256_set1_ps(y), _CMP_GT_OQ));
+		return (unsigned)_mm256_movemask_ps(_mm256_and_ps(hx, hy));
+	}
+#elif defined(ISLS2D__SSE2)
+	if (n == 4) {
+		__m128 ox = _mm_set_ps(sh->x[ids[3]], sh->x[ids[2]], sh->x[ids[1]], sh->x[ids[0]]);
+		__m128 oy = _mm_set_ps(sh->y[ids[3]], sh->y[ids[2]], sh->y[ids[1]], sh->y[ids[0]]);
+		__m128 ox2 = _mm_add_ps(ox, _mm_set_ps(sh->width[ids[3]], sh->width[ids[2]], sh->width[ids[1]], sh->width[ids[0]]));
+		__m128 oy2 = _mm_add_ps(oy, _mm_set_ps(sh->height[ids[3]], sh->height[ids[2]], sh->height[ids[1]], sh->height[ids[0]]));
+		__m128 hx = _mm_and_ps(_mm_cmpgt_ps(_mm_set1_ps(x + width), ox), _mm_cmpgt_ps(ox2, _mm_set1_ps(x)));
+		__m128 hy = _mm_and_ps(_mm_cmpgt_ps(_mm_set1_ps(y + height), oy), _mm_cmpgt_ps(oy2, _mm_set1_ps(y)));
+		return (unsigned)_mm_movemask_ps(_mm_and_ps(hx, hy));
+	}
+#endif
+	unsigned mask = 0;
+	for (int i = 0; i < n; i++) {
+		int o = ids[i];
+		if (isls2d_overlaps(x, y, width, height, sh->x[o], sh->y[o], sh->width[o], sh->height[o])) mask |= 1u << i;
+	}
+	return mask;
+}
+
+// Bit i is set when the category of ids[i] is in the mask
+unsigned isls2d__category_mask(const struct isls2d *sh, isls2d_mask mask, const int *ids, int n) {
+	unsigned bits = 0;
+	for (int i = 0; i < n; i++) {
+		if (sh->categories[ids[i]] & mask) bits |= 1u << i;
+	}
+	return bits;
+}
+
+// Bit i is set when the entity and ids[i] accept each other's categories and at least
+// one of them isn't idle
+unsigned isls2d__pair_mask(const struct isls2d *sh, int id, const int *ids, int n) {
+	isls2d_mask category = sh->categories[id], mask = sh->masks[id];
+	unsigned char idle = sh->flags[id] & ISLS2D__IDLE;
+	unsigned bits = 0;
+	for (int i = 0; i < n; i++) {
+		int o = ids[i];
+		if ((sh->categories[o] & mask) && (category & sh->masks[o]) && !(idle && (sh->flags[o] & ISLS2D__IDLE))) bits |= 1u << i;
+	}
+	return bits;
+}
+
+// Level 0 is the grid itself, coarser levels are grids used only for cells
+struct isls2d *isls2d__level(const struct isls2d *sh, int level) {
+	return level ? &sh->levels[level - 1] : (struct isls2d *)sh;
+}
+
+// Lowest level where the box isn't larger than the cell, or the top level, loose grid
+// has no levels
+int isls2d__pick_level(const struct isls2d *sh, isls2d_float width, isls2d_float height) {
+	isls2d_float size = width * sh->inv_cell_width, size_y = height * sh->inv_cell_height;
+	int level = 0;
+	if (sh->loose) return level;
+	if (size_y > size) size = size_y;
+	for (; level < sh->levels_count && size > 1; level++) size *= 0.5f;
+	return level;
+}
+
+void isls2d__fat_range(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, struct isls2d_range *r) {
+	isls2d_float m = sh->margin;
+	r->level = isls2d__pick_level(sh, width + 2 * m, height + 2 * m);
+	isls2d__entity_range(isls2d__level(sh, r->level), x - m, y - m, width + 2 * m, height + 2 * m, &r->xmin, &r->xmax, &r->ymin, &r->ymax);
+}
+
+unsigned long long isls2d__atomic_load64(unsigned long long *p) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	return (unsigned long long)_InterlockedCompareExchange64((volatile long long *)p, 0, 0);
+#else
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+bool isls2d__atomic_cas64(unsigned long long *p, unsigned long long expected, unsigned long long desired) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	return (unsigned long long)_InterlockedCompareExchange64((volatile long long *)p, (long long)desired, (long long)expected) == expected;
+#else
+	return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void isls2d__atomic_add64(unsigned long long *p, unsigned long long v) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	_InterlockedExchangeAdd64((volatile long long *)p, (long long)v);
+#else
+	__atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+#endif
+}
+
+int isls2d__atomic_load32(int *p) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	return *(volatile int *)p;
+#else
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+#endif
+}
+
+void isls2d__atomic_store32(int *p, int v) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	*(volatile int *)p = v;
+#else
+	__atomic_store_n(p, v, __ATOMIC_RELAXED);
+#endif
+}
+
+void isls2d__lock(int *lock) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	while (_InterlockedExchange((volatile long *)lock, 1)) while (*(volatile int *)lock);
+#else
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) while (__atomic_load_n(lock, __ATOMIC_RELAXED));
+#endif
+}
+
+void isls2d__unlock(int *lock) {
+#ifdef ISLS2D__MSVC_ATOMICS
+	_InterlockedExchange((volatile long *)lock, 0);
+#else
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#endif
+}
+
+// High bits of the hash pick the shard, low bits pick the slot inside of the shard table
+int isls2d__shard_index(const struct isls2d *sh, isls2d_key key) {
+	return (int)(((unsigned long long)isls2d__hash(key) * (unsigned)sh->locks_count) >> 32);
+}
+
+int *isls2d__cell_lock(struct isls2d *sh, int x, int y) {
+	if (sh->grid_width) return &sh->locks[((y - sh->grid_y) * sh->grid_width + (x - sh->grid_x)) % sh->locks_count];
+	return &sh->locks[isls2d__shard_index(sh, ISLS2D_KEY(x, y))];
+}
+
+// Free ids form the Treiber stack linked through reusable_ids, head keeps id + 1 in the
+// low half (0 is the empty stack) and the change counter in the high half, so the stale
+// head is never accepted (ABA)
+void isls2d__push_id(struct isls2d *sh, int id) {
+	for (;;) {
+		unsigned long long head = isls2d__atomic_load64(&sh->reusable_head);
+		isls2d__atomic_store32(&sh->reusable_ids[id], (int)(unsigned)head - 1);
+		if (isls2d__atomic_cas64(&sh->reusable_head, head, (((head >> 32) + 1) << 32) | (unsigned)(id + 1))) return;
+	}
+}
+
+int isls2d__pop_id(struct isls2d *sh) {
+	for (;;) {
+		unsigned long long head = isls2d__atomic_load64(&sh->reusable_head);
+		int id = (int)(unsigned)head - 1;
+		if (id < 0) return -1;
+		int next = isls2d__atomic_load32(&sh->reusable_ids[id]);
+		if (isls2d__atomic_cas64(&sh->reusable_head, head, (((head >> 32) + 1) << 32) | (unsigned)(next + 1))) return id;
+	}
+}
+
+void isls2d__resize_ids(struct isls2d *sh, int n) {
+	isls2d__arrsetlen(sh->entities, n);
+	isls2d__arrsetlen(sh->x, n);
+	isls2d__arrsetlen(sh->y, n);
+	isls2d__arrsetlen(sh->width, n);
+	isls2d__arrsetlen(sh->height, n);
+	isls2d__arrsetlen(sh->ranges, n);
+	isls2d__arrsetlen(sh->query_stamps, n);
+	isls2d__arrsetlen(sh->categories, n);
+	isls2d__arrsetlen(sh->masks, n);
+	isls2d__arrsetlen(sh->flags, n);
+	isls2d__arrsetlen(sh->reusable_ids, n);
+}
+
+int isls2d__alloc_id(struct isls2d *sh) {
+	int id = isls2d__pop_id(sh);
+	if (id >= 0) return id;
+	id = isls2d__arrlen(sh->entities);
+	isls2d__resize_ids(sh, id + 1);
+	sh->query_stamps[id] = 0;
+	return id;
+}
+
+void isls2d__insert_entity_into_cells(struct isls2d *sh, int id, bool locked) {
+	struct isls2d_range r = sh->ranges[id];
+	struct isls2d *grid = isls2d__level(sh, r.level);
+	for (int cx = r.xmin; cx < r.xmax; cx++) {
+		for (int cy = r.ymin; cy < r.ymax; cy++) {
+			int *lock = locked ? isls2d__cell_lock(sh, cx, cy) : NULL;
+			if (lock) isls2d__lock(lock);
+			struct isls2d_cell *cell = isls2d__cell_put(grid, cx, cy);
+			isls2d__arrput(cell->ids, id);
+			cell->categories |= sh->categories[id];
+			if (lock) isls2d__unlock(lock);
+		}
+	}
+}
+
+void isls2d__remove_entity_from_cells(struct isls2d *sh, int id, struct isls2d_range r, bool locked) {
+	struct isls2d *grid = isls2d__level(sh, r.level);
+	for (int cx = r.xmin; cx < r.xmax; cx++) {
+		for (int cy = r.ymin; cy < r.ymax; cy++) {
+			int *lock = locked ? isls2d__cell_lock(sh, cx, cy) : NULL;
+			if (lock) isls2d__lock(lock);
+			struct isls2d_cell *cell = isls2d__cell_get(grid, cx, cy);
+			if (cell != NULL) {
+				int *cell_ids = cell->ids;
+				int n = isls2d__arrlen(cell_ids);
 				for (int i = 0; i < n; i++) {
-					struct isls2d_entity *o = &sh->entities[i];
-					if (isls2d_overlaps(e->x, e->y, e->width, e->height, o->x, o->y, o->width, o->height)) {
-						isls2d__arrsorted_put_if_absent(e->overlaps, o->id);
-						isls2d__arrsorted_put_if_absent(o->overlaps, e->id);
-						//hmput(e->overlaps, o->id, true);
-						//hmput(o->overlaps, e->id, true);
+					if (cell_ids[i] == id) {
+						isls2d__arrdelswap(cell_ids, i);
+						break;
+					}
+				}
+				if (isls2d__arrlen(cell_ids) == 0) isls2d__cell_del(grid, cell);
+			}
+			if (lock) isls2d__unlock(lock);
+		}
+	}
+}
+
+void isls2d__contact(struct isls2d_pair **events, int a, int b) {
+	struct isls2d_pair pair = {a < b ? a : b, a < b ? b : a};
+	struct isls2d_pair *list = *events;
+	isls2d__arrput(list, pair);
+	*events = list;
+}
+
+int isls2d__compare_ints(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+int isls2d__compare_pairs(const void *a, const void *b) {
+	const struct isls2d_pair *x = (const struct isls2d_pair *)a, *y = (const struct isls2d_pair *)b;
+	if (x->a != y->a) return x->a < y->a ? -1 : 1;
+	return (x->b > y->b) - (x->b < y->b);
+}
+
+// Events of the same pair alternate, so the pair with as many began as ended events is
+// in the same state as at the previous drain and is dropped, otherwise one event is kept
+void isls2d__net_contacts(struct isls2d_pair *began, struct isls2d_pair *ended) {
+	int nb = isls2d__arrlen(began), ne = isls2d__arrlen(ended), i = 0, j = 0, kb = 0, ke = 0;
+	if (nb > 1) qsort(began, nb, sizeof(*began), isls2d__compare_pairs);
+	if (ne > 1) qsort(ended, ne, sizeof(*ended), isls2d__compare_pairs);
+	while (i < nb || j < ne) {
+		struct isls2d_pair pair = j >= ne || (i < nb && isls2d__compare_pairs(&began[i], &ended[j]) < 0) ? began[i] : ended[j];
+		int count = 0;
+		for (; i < nb && began[i].a == pair.a && began[i].b == pair.b; i++) count++;
+		for (; j < ne && ended[j].a == pair.a && ended[j].b == pair.b; j++) count--;
+		if (count > 0) began[kb++] = pair;
+		else if (count < 0) ended[ke++] = pair;
+	}
+	if (began) isls2d__arrheader(began)->length = kb;
+	if (ended) isls2d__arrheader(ended)->length = ke;
+}
+
+// Recomputes overlaps of the entity from its cells and merges them with the previous
+// sorted overlaps, emitting began/ended events only for the difference
+void isls2d__track_overlaps(struct isls2d *sh, int id) {
+	struct isls2d_entity *e = &sh->entities[id];
+	bool is_static = sh->flags[id] & ISLS2D__STATIC;
+	if (sh->static_dirty && !is_static) isls2d__build_statics(sh);
+	isls2d_float x = sh->x[id], y = sh->y[id], width = sh->width[id], height = sh->height[id];
+	unsigned epoch = isls2d__query_begin(sh);
+	int *current = sh->overlaps_scratch;
+	isls2d__arrsetlen(current, 0);
+	sh->query_stamps[id] = epoch;
+	// Cells are scanned by the exact box, any overlapping entity shares one of them
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		struct isls2d_range r;
+		isls2d__query_range(grid, x, y, width, height, &r.xmin, &r.xmax, &r.ymin, &r.ymax);
+		for (int cx = r.xmin; cx < r.xmax; cx++) {
+			for (int cy = r.ymin; cy < r.ymax; cy++) {
+				// Static entity skips the static partition
+				for (int s = 0; s < (is_static ? 1 : 2); s++) {
+					int n;
+					isls2d_mask categories;
+					const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, &categories);
+					if (!(categories & sh->masks[id])) continue;
+					for (int i = 0; i < n; i += ISLS2D__LANES) {
+						int lanes = n - i < ISLS2D__LANES ? n - i : ISLS2D__LANES;
+						unsigned mask = isls2d__pair_mask(sh, id, cell_ids + i, lanes);
+						if (mask) mask &= isls2d__overlap_mask(sh, x, y, width, height, cell_ids + i, lanes);
+						for (int j = i; mask; j++, mask >>= 1) {
+							if (!(mask & 1)) continue;
+							int o = cell_ids[j];
+							if (sh->query_stamps[o] == epoch) continue;
+							sh->query_stamps[o] = epoch;
+							isls2d__arrput(current, o);
+						}
+					}
+				}
+			}
+		}
+	}
+	int n, m = isls2d__arrlen(e->overlaps), i = 0, j = 0;
+	// Idle pairs aren't candidates of the scan, their contacts are kept while boxes overlap
+	if (sh->flags[id] & ISLS2D__IDLE) {
+		for (int k = 0; k < m; k++) {
+			int o = e->overlaps[k];
+			if (!(sh->flags[o] & ISLS2D__IDLE) || sh->query_stamps[o] == epoch) continue;
+			if (!(sh->categories[o] & sh->masks[id]) || !(sh->categories[id] & sh->masks[o])) continue;
+			if (isls2d_overlaps(x, y, width, height, sh->x[o], sh->y[o], sh->width[o], sh->height[o])) isls2d__arrput(current, o);
+		}
+	}
+	n = isls2d__arrlen(current);
+	if (n > 1) qsort(current, n, sizeof(*current), isls2d__compare_ints);
+	while (i < n || j < m) {
+		if (j >= m || (i < n && current[i] < e->overlaps[j])) {
+			int o = current[i++];
+			sh->entities[o].overlaps = isls2d__arrsorted_put_if_absent(sh->entities[o].overlaps, id);
+			isls2d__contact(&sh->began, id, o);
+		} else if (i >= n || e->overlaps[j] < current[i]) {
+			int o = e->overlaps[j++];
+			sh->entities[o].overlaps = isls2d__arrsorted_del(sh->entities[o].overlaps, id);
+			isls2d__contact(&sh->ended, id, o);
+		} else {
+			i++;
+			j++;
+		}
+	}
+	// Previous overlaps array becomes the scratch for the next call
+	sh->overlaps_scratch = e->overlaps;
+	e->overlaps = current;
+}
+
+// Wakes the sleeping entity when its box changes, returns false when the box is the same
+// and the entity keeps sleeping, so there's nothing to update
+bool isls2d__touch(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
+	if (!(sh->flags[id] & ISLS2D__SLEEPING)) return true;
+	if (x == sh->x[id] && y == sh->y[id] && width == sh->width[id] && height == sh->height[id]) return false;
+	sh->flags[id] &= ~ISLS2D__SLEEPING;
+	return true;
+}
+
+// Stores the new box and decides whether the entity has to be re-bucketed, in which
+// case the new (fat) range is stored as well, old range should be saved by the caller,
+// stats are passed separately to let concurrent updates count into local ones
+bool isls2d__update_range(struct isls2d *sh, struct isls2d_stats *stats, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
+	struct isls2d_range r, *old = &sh->ranges[id];
+	// Entity moves to another level when its size crosses the cell size of the level
+	r.level = isls2d__pick_level(sh, width + 2 * sh->margin, height + 2 * sh->margin);
+	const struct isls2d *grid = isls2d__level(sh, r.level);
+	isls2d__entity_range(grid, x, y, width, height, &r.xmin, &r.xmax, &r.ymin, &r.ymax);
+	bool rebucket;
+	if (r.level != old->level) {
+		rebucket = true;
+	} else if (sh->margin > 0) {
+		// With fat ranges entity stays in its cells while the box is inside of them
+		rebucket = r.xmin < old->xmin || r.xmax > old->xmax || r.ymin < old->ymin || r.ymax > old->ymax;
+		if (!rebucket) {
+			struct isls2d_range prev;
+			isls2d__entity_range(grid, sh->x[id], sh->y[id], sh->width[id], sh->height[id], &prev.xmin, &prev.xmax, &prev.ymin, &prev.ymax);
+			if (r.xmin != prev.xmin || r.xmax != prev.xmax || r.ymin != prev.ymin || r.ymax != prev.ymax) stats->rebuckets_avoided++;
+		}
+	} else {
+		rebucket = r.xmin != old->xmin || r.xmax != old->xmax || r.ymin != old->ymin || r.ymax != old->ymax;
+	}
+	sh->x[id] = x;
+	sh->y[id] = y;
+	sh->width[id] = width;
+	sh->height[id] = height;
+	if (rebucket) {
+		isls2d__fat_range(sh, x, y, width, height, old);
+		stats->rebuckets++;
+	}
+	return rebucket;
+}
+
+void isls2d__batch_emit(struct isls2d *sh, int id, struct isls2d_range from, struct isls2d_range except, bool insert) {
+	for (int cx = from.xmin; cx < from.xmax; cx++) {
+		for (int cy = from.ymin; cy < from.ymax; cy++) {
+			if (cx >= except.xmin && cx < except.xmax && cy >= except.ymin && cy < except.ymax) continue;
+			struct isls2d__batch_op op = {ISLS2D_KEY(cx, cy), cx, cy, id, isls2d__arrlen(sh->batch_ops), insert};
+			isls2d__arrput(sh->batch_ops, op);
+		}
+	}
+}
+
+int isls2d__compare_batch_ops(const void *a, const void *b) {
+	const struct isls2d__batch_op *x = (const struct isls2d__batch_op *)a, *y = (const struct isls2d__batch_op *)b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+void isls2d__run(struct isls2d *sh, isls2d_task_fn task, struct isls2d__job *job) {
+	if (sh->parallel && job->tasks > 1) {
+		sh->parallel(task, job, job->tasks, sh->parallel_udata);
+	} else {
+		for (int i = 0; i < job->tasks; i++) task(job, i);
+	}
+}
+
+void isls2d__chunk(int n, int tasks, int index, int *begin, int *end) {
+	*begin = (int)((long long)n * index / tasks);
+	*end = (int)((long long)n * (index + 1) / tasks);
+}
+
+// Rebuild runs in stages, every stage is split into tasks working on disjoint chunks of
+// entities or entries, tasks store their counts in task_counts, serial prefix sums turn
+// them into offsets of the following stage
+void isls2d__rebuild_count_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, count = 0;
+	isls2d__chunk(isls2d__arrlen(sh->entities), job->tasks, index, &begin, &end);
+	for (int id = begin; id < end; id++) {
+		if (sh->entities[id].id != id || (sh->flags[id] & ISLS2D__STATIC)) continue;
+		struct isls2d_range *r = &sh->ranges[id];
+		isls2d__entity_range(sh, sh->x[id], sh->y[id], sh->width[id], sh->height[id], &r->xmin, &r->xmax, &r->ymin, &r->ymax);
+		r->level = 0;
+		count += (r->xmax - r->xmin) * (r->ymax - r->ymin);
+	}
+	sh->task_counts[index * 256] = count;
+}
+
+void isls2d__rebuild_emit_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, k = sh->task_counts[index * 256];
+	isls2d__chunk(isls2d__arrlen(sh->entities), job->tasks, index, &begin, &end);
+	for (int id = begin; id < end; id++) {
+		if (sh->entities[id].id != id || (sh->flags[id] & ISLS2D__STATIC)) continue;
+		struct isls2d_range r = sh->ranges[id];
+		for (int cx = r.xmin; cx < r.xmax; cx++) {
+			for (int cy = r.ymin; cy < r.ymax; cy++) {
+				sh->flat_entries[k].key = ISLS2D_KEY(cx, cy);
+				sh->flat_entries[k++].id = id;
+			}
+		}
+	}
+}
+
+// LSD radix sort of flat entries by unsigned key, 8 bits per pass, every task counts
+// digits of its chunk and scatters them to the offsets after all digits of lower tasks,
+// so the sort stays stable
+void isls2d__radix_count_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, *counts = sh->task_counts + index * 256;
+	isls2d__chunk(isls2d__arrlen(sh->flat_entries), job->tasks, index, &begin, &end);
+	memset(counts, 0, 256 * sizeof(*counts));
+	for (int i = begin; i < end; i++) counts[((isls2d__ukey)sh->flat_entries[i].key >> job->shift) & 0xff]++;
+}
+
+void isls2d__radix_scatter_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, *offsets = sh->task_counts + index * 256;
+	isls2d__chunk(isls2d__arrlen(sh->flat_entries), job->tasks, index, &begin, &end);
+	for (int i = begin; i < end; i++) {
+		struct isls2d__flat_entry entry = sh->flat_entries[i];
+		sh->flat_scratch[offsets[((isls2d__ukey)entry.key >> job->shift) & 0xff]++] = entry;
+	}
+}
+
+// Copies ids of sorted entries and counts the cells starting in the chunk
+void isls2d__cells_count_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, count = 0;
+	isls2d__chunk(isls2d__arrlen(sh->flat_entries), job->tasks, index, &begin, &end);
+	for (int i = begin; i < end; i++) {
+		sh->flat_ids[i] = sh->flat_entries[i].id;
+		if (i == 0 || sh->flat_entries[i].key != sh->flat_entries[i - 1].key) count++;
+	}
+	sh->task_counts[index * 256] = count;
+}
+
+void isls2d__cells_emit_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	int begin, end, k = sh->task_counts[index * 256];
+	isls2d__chunk(isls2d__arrlen(sh->flat_entries), job->tasks, index, &begin, &end);
+	for (int i = begin; i < end; i++) {
+		if (i > 0 && sh->flat_entries[i].key == sh->flat_entries[i - 1].key) continue;
+		isls2d_mask categories = 0;
+		for (int j = i; j < isls2d__arrlen(sh->flat_entries) && sh->flat_entries[j].key == sh->flat_entries[i].key; j++) categories |= sh->categories[sh->flat_ids[j]];
+		sh->flat_keys[k] = sh->flat_entries[i].key;
+		sh->flat_categories[k] = categories;
+		sh->flat_starts[k++] = i;
+	}
+}
+
+// Every task finds pairs in its own range of cells, single task writes directly into
+// the result
+void isls2d__pairs_task(void *task_data, int index) {
+	struct isls2d__job *job = (struct isls2d__job *)task_data;
+	struct isls2d *sh = job->sh;
+	struct isls2d_pair **pairs = job->tasks > 1 ? &sh->task_pairs[index] : &sh->pairs, *list = *pairs;
+	int begin, end, cx, cy;
+	isls2d__arrsetlen(list, 0);
+	*pairs = list;
+	if (sh->rebuild_mode) {
+		isls2d__chunk(isls2d__arrlen(sh->flat_keys), job->tasks, index, &begin, &end);
+		for (int k = begin; k < end; k++) {
+			isls2d__key_cell(sh, sh->flat_keys[k], &cx, &cy);
+			isls2d__cell_pairs(sh, pairs, 0, cx, cy, sh->flat_ids + sh->flat_starts[k], sh->flat_starts[k + 1] - sh->flat_starts[k]);
+		}
+	} else {
+		for (int l = 0; l <= sh->levels_count; l++) {
+			struct isls2d *grid = isls2d__level(sh, l), *tables = grid->shards ? grid->shards : grid;
+			for (int s = 0; s < (grid->shards ? grid->locks_count : 1); s++) {
+				struct isls2d *table = &tables[s];
+				isls2d__chunk(table->cells_capacity, job->tasks, index, &begin, &end);
+				for (int k = begin; k < end; k++) {
+					// Bounded cells are indexed by coordinates, so they aren't decoded from keys
+					if (grid->grid_width) {
+						cx = grid->grid_x + k % grid->grid_width;
+						cy = grid->grid_y + k / grid->grid_width;
+					} else {
+						isls2d__key_cell(grid, table->cells[k].key, &cx, &cy);
 					}
+					isls2d__cell_pairs(sh, pairs, l, cx, cy, table->cells[k].ids, isls2d__arrlen(table->cells[k].ids));
+				}
+			}
+		}
+	}
+	if (sh->levels_count) {
+		isls2d__chunk(isls2d__arrlen(sh->entities), job->tasks, index, &begin, &end);
+		for (int id = begin; id < end; id++) {
+			if (sh->entities[id].id == id) isls2d__level_pairs(sh, pairs, id);
+		}
+	}
+}
+
+// Replaces the first count of every task by its offset, returns the total
+int isls2d__prefix_sum(struct isls2d *sh, int tasks) {
+	int total = 0;
+	for (int i = 0; i < tasks; i++) {
+		int count = sh->task_counts[i * 256];
+		sh->task_counts[i * 256] = total;
+		total += count;
+	}
+	return total;
+}
+
+// Coordinates of the cell with the key, they wrap around with the key, which is fine for
+// hashed cells, but wrapped cells of the bounded grid are moved back into its bounds
+void isls2d__key_cell(const struct isls2d *sh, isls2d_key key, int *cx, int *cy) {
+	*cx = ISLS2D_X(key);
+	*cy = ISLS2D_Y(key);
+	if (sh->grid_width) {
+		*cx = sh->grid_x + (int)((isls2d__ukey)(unsigned)(*cx - sh->grid_x) & ISLS2D_KEY_MASK);
+		*cy = sh->grid_y + (int)((isls2d__ukey)(unsigned)(*cy - sh->grid_y) & ISLS2D_KEY_MASK);
+	}
+}
+
+// Pairs of the dynamic cell and pairs of its entities with static entities of the same
+// cell of the level
+void isls2d__cell_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int level, int cx, int cy, const int *cell_ids, int n) {
+	int nstatics = 0;
+	isls2d_key key = ISLS2D_KEY(cx, cy);
+	const int *statics = n > 0 ? isls2d__cell_ids(isls2d__level(sh, level), cx, cy, true, &nstatics, NULL) : NULL;
+	for (int i = 0; i < n; i++) {
+		isls2d__entity_pairs(sh, pairs, key, cell_ids[i], sh->ranges[cell_ids[i]], cell_ids + i + 1, n - i - 1);
+		isls2d__entity_pairs(sh, pairs, key, cell_ids[i], sh->ranges[cell_ids[i]], statics, nstatics);
+	}
+	if (sh->loose && n > 0) isls2d__loose_pairs(sh, pairs, cx, cy, cell_ids, n);
+}
+
+// Range of the entity a is given in cells of the level of cell_ids
+void isls2d__entity_pairs(struct isls2d *sh, struct isls2d_pair **pairs, isls2d_key key, int a, struct isls2d_range ra, const int *cell_ids, int n) {
+	struct isls2d_pair *list = *pairs;
+	for (int j = 0; j < n; j += ISLS2D__LANES) {
+		int lanes = n - j < ISLS2D__LANES ? n - j : ISLS2D__LANES;
+		unsigned mask = isls2d__pair_mask(sh, a, cell_ids + j, lanes);
+		if (!mask) continue;
+		mask &= isls2d__overlap_mask(sh, sh->x[a], sh->y[a], sh->width[a], sh->height[a], cell_ids + j, lanes);
+		for (int l = j; mask; l++, mask >>= 1) {
+			if (!(mask & 1)) continue;
+			int b = cell_ids[l];
+			struct isls2d_range rb = sh->ranges[b];
+			// Pair is owned by the lowest cell shared by both entities, other shared cells skip it
+			int ox = ra.xmin > rb.xmin ? ra.xmin : rb.xmin, oy = ra.ymin > rb.ymin ? ra.ymin : rb.ymin;
+			if (ISLS2D_KEY(ox, oy) != key) continue;
+			struct isls2d_pair pair = {a < b ? a : b, a < b ? b : a};
+			isls2d__arrput(list, pair);
+		}
+	}
+	*pairs = list;
+}
+
+void isls2d__update_static(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
+	sh->x[id] = x;
+	sh->y[id] = y;
+	sh->width[id] = width;
+	sh->height[id] = height;
+	// Static entity doesn't move every tick, so it has no margin
+	struct isls2d_range *r = &sh->ranges[id];
+	r->level = isls2d__pick_level(sh, width, height);
+	isls2d__entity_range(isls2d__level(sh, r->level), x, y, width, height, &r->xmin, &r->xmax, &r->ymin, &r->ymax);
+	sh->static_dirty = true;
+	// Static entity overlaps only dynamic ones, in rebuild mode they are tracked on rebuild
+	if (sh->rebuild_mode) sh->flat_dirty = sh->flat_dirty || sh->track_overlap;
+	else if (sh->track_overlap) isls2d__track_overlaps(sh, id);
+}
+
+// Pairs of the entity with entities of coarser levels, the entity range is converted into
+// cells of the coarser level, so ownership works as for entities of the same level
+void isls2d__level_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int id) {
+	isls2d_float x = sh->x[id], y = sh->y[id], width = sh->width[id], height = sh->height[id];
+	bool is_static = sh->flags[id] & ISLS2D__STATIC;
+	for (int l = sh->ranges[id].level + 1; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		struct isls2d_range r;
+		isls2d__cell_range(grid, x, y, width, height, &r.xmin, &r.xmax, &r.ymin, &r.ymax);
+		for (int cx = r.xmin; cx < r.xmax; cx++) {
+			for (int cy = r.ymin; cy < r.ymax; cy++) {
+				// Static entity skips static partitions
+				for (int s = 0; s < (is_static ? 1 : 2); s++) {
+					int n;
+					const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, NULL);
+					isls2d__entity_pairs(sh, pairs, ISLS2D_KEY(cx, cy), id, r, cell_ids, n);
 				}
 			}
-			arrput(cell_ids, id);
-			if (n == 1) hmput(sh->cells, key, cell_ids);
-		}
-	}
-}
-
-void isls2d__remove_entity_from_cells(struct isls2d *sh, int id, int xmin, int xmax, int ymin, int ymax) {
-	for (int x = xmin; x < xmax; x++) {
-		for (int y = ymin; y < ymax; y++) {
-			int key = ISLS2D_KEY(x, y);
-			int *cell_ids = hmget(sh->cells, key);
-			int n = arrlen(cell_ids);
-			for (int i = 0; i < n; i++) {
-				if (ids[i] == id) {
-					arrdelswap(cell_ids, i);
-					if (track_overlap) {
-						for (int j = 0; j < n-1; j++) {
-							struct isls2d_entity *o = &sh->entities[i];
-							isls2d__arrsorted_del(e->overlaps, o->id);
-							isls2d__arrsorted_del(o->overlaps, e->id);
-							//hmdel(e->overlaps, o->id);
-							//hmdel(o->overlaps, e->id);
+		}
+	}
+}
+
+// Pairs of the loose cell with neighbor cells close enough to hold overlapping entities.
+// Dynamic cells are paired only with the following half of neighbors, so every two cells
+// are paired once, static cells are looked up around every dynamic one. Key of the pair
+// of cells is passed as the owner, so the ownership check passes for them
+void isls2d__loose_pairs(struct isls2d *sh, struct isls2d_pair **pairs, int cx, int cy, const int *cell_ids, int n) {
+	int nb;
+	int rx = isls2d__ceil(sh->loose_width * sh->inv_cell_width), ry = isls2d__ceil(sh->loose_height * sh->inv_cell_height);
+	for (int dy = -ry; dy <= ry; dy++) {
+		for (int dx = -rx; dx <= rx; dx++) {
+			if (dx == 0 && dy == 0) continue;
+			if (sh->grid_width && (cx + dx < sh->grid_x || cx + dx >= sh->grid_x + sh->grid_width || cy + dy < sh->grid_y || cy + dy >= sh->grid_y + sh->grid_height)) continue;
+			isls2d_key owner = ISLS2D_KEY(dx > 0 ? cx + dx : cx, dy > 0 ? cy + dy : cy);
+			for (int s = dy > 0 || (dy == 0 && dx > 0) ? 0 : 1; s < 2; s++) {
+				const int *neighbors = isls2d__cell_ids(sh, cx + dx, cy + dy, s, &nb, NULL);
+				for (int i = 0; nb > 0 && i < n; i++) isls2d__entity_pairs(sh, pairs, owner, cell_ids[i], sh->ranges[cell_ids[i]], neighbors, nb);
+			}
+		}
+	}
+}
+
+int isls2d__compare_flat_entries(const void *a, const void *b) {
+	const struct isls2d__flat_entry *x = (const struct isls2d__flat_entry *)a, *y = (const struct isls2d__flat_entry *)b;
+	if (x->key != y->key) return (isls2d__ukey)x->key < (isls2d__ukey)y->key ? -1 : 1;
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+// Sorts (cell, id) entries into compact cells: sorted keys, starts of cells in ids with
+// the total count at the end and OR of categories of entities of every cell
+void isls2d__sort_cells(const struct isls2d *sh, struct isls2d__flat_entry *entries, isls2d_key **pkeys, int **pstarts, int **pids, isls2d_mask **pcategories) {
+	isls2d_key *keys = *pkeys;
+	int *starts = *pstarts, *ids = *pids, n = isls2d__arrlen(entries), ncells = 0;
+	isls2d_mask *categories = *pcategories;
+	if (n > 1) qsort(entries, n, sizeof(*entries), isls2d__compare_flat_entries);
+	isls2d__arrsetlen(ids, n);
+	isls2d__arrsetlen(keys, 0);
+	isls2d__arrsetlen(starts, 0);
+	isls2d__arrsetlen(categories, 0);
+	for (int i = 0; i < n; i++) {
+		int id = ids[i] = entries[i].id;
+		if (i == 0 || entries[i].key != entries[i - 1].key) {
+			isls2d__arrput(keys, entries[i].key);
+			isls2d__arrput(starts, i);
+			isls2d__arrput(categories, 0);
+			ncells++;
+		}
+		categories[ncells - 1] |= sh->categories[id];
+	}
+	isls2d__arrput(starts, n);
+	*pkeys = keys;
+	*pstarts = starts;
+	*pids = ids;
+	*pcategories = categories;
+}
+
+// Static partitions are rebuilt serially from scratch, they change rarely, every level
+// has its own static cells
+void isls2d__build_statics(struct isls2d *sh) {
+	int count = isls2d__arrlen(sh->entities);
+	for (int l = 0; l <= sh->levels_count; l++) isls2d__arrsetlen(isls2d__level(sh, l)->static_entries, 0);
+	for (int id = 0; id < count; id++) {
+		if (sh->entities[id].id != id || !(sh->flags[id] & ISLS2D__STATIC)) continue;
+		struct isls2d_range r = sh->ranges[id];
+		struct isls2d *grid = isls2d__level(sh, r.level);
+		for (int cx = r.xmin; cx < r.xmax; cx++) {
+			for (int cy = r.ymin; cy < r.ymax; cy++) {
+				struct isls2d__flat_entry entry = {ISLS2D_KEY(cx, cy), id};
+				isls2d__arrput(grid->static_entries, entry);
+			}
+		}
+	}
+	for (int l = 0; l <= sh->levels_count; l++) {
+		struct isls2d *grid = isls2d__level(sh, l);
+		isls2d__sort_cells(sh, grid->static_entries, &grid->static_keys, &grid->static_starts, &grid->static_ids, &grid->static_categories);
+	}
+	sh->static_dirty = false;
+}
+
+// Brings lazily rebuilt cells up to date before reading them
+void isls2d__refresh(struct isls2d *sh) {
+	if (sh->loose_dirty) isls2d__loose_shrink(sh);
+	if (sh->static_dirty) isls2d__build_statics(sh);
+	if (sh->flat_dirty) isls2d_rebuild(sh);
+}
+
+void *isls2d__arrcopy(void *a, const void *b, size_t item_size) {
+	int n = isls2d__arrlen(b);
+	if (n > isls2d__arrcap(a)) a = isls2d__arrgrow(a, item_size, n);
+	if (a) isls2d__arrheader(a)->length = n;
+	if (n > 0) memcpy(a, b, item_size * n);
+	return a;
+}
+
+bool isls2d__circle_overlaps(isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_float bx, isls2d_float by, isls2d_float bwidth, isls2d_float bheight) {
+	isls2d_float dx = x < bx ? bx - x : (x > bx + bwidth ? x - bx - bwidth : 0);
+	isls2d_float dy = y < by ? by - y : (y > by + bheight ? y - by - bheight : 0);
+	return dx * dx + dy * dy < radius * radius;
+}
+
+// Cells of the row intersecting the circle, clamped into the query range like cell
+// ranges are, returns false when the row is outside of the circle
+bool isls2d__circle_span(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, int cy, int xmin, int xmax, int *from, int *to) {
+	isls2d_float top = cy / sh->inv_cell_height, bottom = (cy + 1) / sh->inv_cell_height, dy = 0;
+	// Border rows of the bounded grid hold everything beyond the bounds
+	if (y < top && !(sh->grid_width && cy == sh->grid_y)) dy = top - y;
+	else if (y > bottom && !(sh->grid_width && cy == sh->grid_y + sh->grid_height - 1)) dy = y - bottom;
+	if (dy >= radius) return false;
+	isls2d_float half = isls2d__sqrt(radius * radius - dy * dy);
+	*from = isls2d__floor((x - half) * sh->inv_cell_width);
+	*to = isls2d__ceil((x + half) * sh->inv_cell_width);
+	if (*from < xmin) *from = xmin; else if (*from >= xmax) *from = xmax - 1;
+	if (*to <= *from) *to = *from + 1; else if (*to > xmax) *to = xmax;
+	return true;
+}
+
+// Shared traversal of live queries. Negative radius is a rect query, otherwise x, y is
+// the center of the circle and the size is ignored. Without callback entities are only
+// counted, any query returns on the first overlap, so it needs no dedup
+int isls2d__query(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_float radius, isls2d_mask mask, bool any, isls2d_query_fn fn, void *udata) {
+	int xmin, xmax, ymin, ymax, count = 0;
+	isls2d__refresh(sh);
+	isls2d_float bx = radius >= 0 ? x - radius : x, by = radius >= 0 ? y - radius : y;
+	if (radius >= 0) width = height = 2 * radius;
+	unsigned epoch = any ? 0 : isls2d__query_begin(sh);
+	// Centers of loose entities overlapping the circle are within the circle grown by the
+	// half diagonal of the largest size
+	isls2d_float reach = radius;
+	if (sh->loose) reach += 0.5f * isls2d__sqrt(sh->loose_width * sh->loose_width + sh->loose_height * sh->loose_height);
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		isls2d__query_range(grid, bx, by, width, height, &xmin, &xmax, &ymin, &ymax);
+		for (int cy = ymin; cy < ymax; cy++) {
+			int from = xmin, to = xmax;
+			if (radius >= 0 && !isls2d__circle_span(grid, x, y, reach, cy, xmin, xmax, &from, &to)) continue;
+			for (int cx = from; cx < to; cx++) {
+				for (int s = 0; s < 2; s++) {
+					int n;
+					isls2d_mask categories;
+					const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, &categories);
+					if (!(categories & mask)) continue;
+					for (int i = 0; i < n; i += ISLS2D__LANES) {
+						int lanes = n - i < ISLS2D__LANES ? n - i : ISLS2D__LANES;
+						unsigned bits = isls2d__category_mask(sh, mask, cell_ids + i, lanes);
+						if (!bits) continue;
+						bits &= isls2d__overlap_mask(sh, bx, by, width, height, cell_ids + i, lanes);
+						for (int j = i; bits; j++, bits >>= 1) {
+							if (!(bits & 1)) continue;
+							int id = cell_ids[j];
+							// Entity spanning several cells is tested and reported only once
+							if (!any) {
+								if (sh->query_stamps[id] == epoch) continue;
+								sh->query_stamps[id] = epoch;
+							}
+							if (radius >= 0 && !isls2d__circle_overlaps(x, y, radius, sh->x[id], sh->y[id], sh->width[id], sh->height[id])) continue;
+							count++;
+							if (any || (fn && fn(id, sh->entities[id].data, udata))) return count;
 						}
 					}
-					break;		
 				}
 			}
-			if (arrlen(cell_ids) == 0) {
-				arrfree(ids);
-				(void)hmdel(sh->cells, key);
+		}
+	}
+	return count;
+}
+
+// Cell containing the point, outside of the bounded grid it's the border cell
+void isls2d__point_cell(const struct isls2d *sh, isls2d_float x, isls2d_float y, int *cx, int *cy) {
+	*cx = isls2d__floor(x * sh->inv_cell_width);
+	*cy = isls2d__floor(y * sh->inv_cell_height);
+	if (sh->grid_width) {
+		if (*cx < sh->grid_x) *cx = sh->grid_x; else if (*cx >= sh->grid_x + sh->grid_width) *cx = sh->grid_x + sh->grid_width - 1;
+		if (*cy < sh->grid_y) *cy = sh->grid_y; else if (*cy >= sh->grid_y + sh->grid_height) *cy = sh->grid_y + sh->grid_height - 1;
+	}
+}
+
+int isls2d__compare_point_ops(const void *a, const void *b) {
+	const struct isls2d__point_op *x = (const struct isls2d__point_op *)a, *y = (const struct isls2d__point_op *)b;
+	if (x->key != y->key) return (isls2d__ukey)x->key < (isls2d__ukey)y->key ? -1 : 1;
+	return (x->index > y->index) - (x->index < y->index);
+}
+
+// Sifts the element down in the max heap of neighbors by distance
+void isls2d__heap_down(struct isls2d_neighbor *heap, int n, int i) {
+	for (;;) {
+		int l = 2 * i + 1, r = l + 1, m = i;
+		if (l < n && heap[l].distance > heap[m].distance) m = l;
+		if (r < n && heap[r].distance > heap[m].distance) m = r;
+		if (m == i) return;
+		struct isls2d_neighbor t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+// Ray parameter where the ray leaves the box of all entities, 0 when it misses the box
+isls2d_float isls2d__ray_extent(const struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float inv_dx, isls2d_float inv_dy, isls2d_float dx, isls2d_float dy, isls2d_float max_t) {
+	isls2d_float xmin = 0, ymin = 0, xmax = 0, ymax = 0, tmin = 0, tmax = max_t;
+	bool empty = true;
+	for (int id = 0; id < isls2d__arrlen(sh->entities); id++) {
+		if (sh->entities[id].id != id) continue;
+		if (empty || sh->x[id] < xmin) xmin = sh->x[id];
+		if (empty || sh->y[id] < ymin) ymin = sh->y[id];
+		if (empty || sh->x[id] + sh->width[id] > xmax) xmax = sh->x[id] + sh->width[id];
+		if (empty || sh->y[id] + sh->height[id] > ymax) ymax = sh->y[id] + sh->height[id];
+		empty = false;
+	}
+	if (empty) return 0;
+	// Same slab test as for entities, so hits of entities are never past the extent
+	if (dx != 0) {
+		isls2d_float t1 = (xmin - x) * inv_dx, t2 = (xmax - x) * inv_dx;
+		if (t1 > t2) { isls2d_float t = t1; t1 = t2; t2 = t; }
+		if (t1 > tmin) tmin = t1;
+		if (t2 < tmax) tmax = t2;
+	} else if (x < xmin || x > xmax) {
+		return 0;
+	}
+	if (dy != 0) {
+		isls2d_float t1 = (ymin - y) * inv_dy, t2 = (ymax - y) * inv_dy;
+		if (t1 > t2) { isls2d_float t = t1; t1 = t2; t2 = t; }
+		if (t1 > tmin) tmin = t1;
+		if (t2 < tmax) tmax = t2;
+	} else if (y < ymin || y > ymax) {
+		return 0;
+	}
+	return tmin <= tmax ? tmax : 0;
+}
+
+// Offers entities to the heap of k best (squared distances)
+void isls2d__knn_ids(struct isls2d *sh, isls2d_float x, isls2d_float y, const int *cell_ids, int n, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count) {
+	for (int i = 0; i < n; i++) {
+		int id = cell_ids[i];
+		if (sh->query_stamps[id] == epoch || !(sh->categories[id] & mask)) continue;
+		sh->query_stamps[id] = epoch;
+		isls2d_float bx = sh->x[id], by = sh->y[id];
+		isls2d_float dx = x < bx ? bx - x : (x > bx + sh->width[id] ? x - bx - sh->width[id] : 0);
+		isls2d_float dy = y < by ? by - y : (y > by + sh->height[id] ? y - by - sh->height[id] : 0);
+		isls2d_float d2 = dx * dx + dy * dy;
+		if (d2 > max_distance2) continue;
+		if (*count < k) {
+			int j = (*count)++;
+			for (; j > 0 && heap[(j - 1) / 2].distance < d2; j = (j - 1) / 2) heap[j] = heap[(j - 1) / 2];
+			heap[j].id = id;
+			heap[j].distance = d2;
+		} else if (d2 < heap[0].distance) {
+			heap[0].id = id;
+			heap[0].distance = d2;
+			isls2d__heap_down(heap, k, 0);
+		}
+	}
+}
+
+// Offers entities of the cell, returns the number of non-empty partitions of the cell
+int isls2d__knn_cell(struct isls2d *sh, const struct isls2d *grid, isls2d_float x, isls2d_float y, int cx, int cy, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count) {
+	int n, occupied = 0;
+	if (grid->grid_width) {
+		if (cx < grid->grid_x) cx = grid->grid_x; else if (cx >= grid->grid_x + grid->grid_width) cx = grid->grid_x + grid->grid_width - 1;
+		if (cy < grid->grid_y) cy = grid->grid_y; else if (cy >= grid->grid_y + grid->grid_height) cy = grid->grid_y + grid->grid_height - 1;
+	}
+	for (int s = 0; s < 2; s++) {
+		const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, NULL);
+		occupied += n > 0;
+		isls2d__knn_ids(sh, x, y, cell_ids, n, mask, epoch, max_distance2, heap, k, count);
+	}
+	return occupied;
+}
+
+// Offers entities of every cell of the level, in any order
+void isls2d__knn_scan(struct isls2d *sh, const struct isls2d *grid, isls2d_float x, isls2d_float y, isls2d_mask mask, unsigned epoch, isls2d_float max_distance2, struct isls2d_neighbor *heap, int k, int *count) {
+	if (grid->rebuild_mode) {
+		for (int i = 0; i < isls2d__arrlen(grid->flat_keys); i++) {
+			isls2d__knn_ids(sh, x, y, grid->flat_ids + grid->flat_starts[i], grid->flat_starts[i + 1] - grid->flat_starts[i], mask, epoch, max_distance2, heap, k, count);
+		}
+	} else {
+		const struct isls2d *tables = grid->shards ? grid->shards : grid;
+		for (int s = 0; s < (grid->shards ? grid->locks_count : 1); s++) {
+			for (int i = 0; i < tables[s].cells_capacity; i++) {
+				isls2d__knn_ids(sh, x, y, tables[s].cells[i].ids, isls2d__arrlen(tables[s].cells[i].ids), mask, epoch, max_distance2, heap, k, count);
+			}
+		}
+	}
+	for (int i = 0; i < isls2d__arrlen(grid->static_keys); i++) {
+		isls2d__knn_ids(sh, x, y, grid->static_ids + grid->static_starts[i], grid->static_starts[i + 1] - grid->static_starts[i], mask, epoch, max_distance2, heap, k, count);
+	}
+}
+
+int isls2d__compare_neighbors(const void *a, const void *b) {
+	isls2d_float x = ((const struct isls2d_neighbor *)a)->distance, y = ((const struct isls2d_neighbor *)b)->distance;
+	return (x > y) - (x < y);
+}
+
+// Layout of the level without entities, static cells are copied as they are
+void isls2d__snapshot_level(const struct isls2d *grid, struct isls2d *frozen) {
+	frozen->inv_cell_width = grid->inv_cell_width;
+	frozen->inv_cell_height = grid->inv_cell_height;
+	frozen->grid_x = grid->grid_x;
+	frozen->grid_y = grid->grid_y;
+	frozen->grid_width = grid->grid_width;
+	frozen->grid_height = grid->grid_height;
+	frozen->loose = grid->loose;
+	frozen->loose_width = grid->loose_width;
+	frozen->loose_height = grid->loose_height;
+	frozen->rebuild_mode = true;
+	frozen->static_keys = isls2d__arrcast(frozen->static_keys) isls2d__arrcopy(frozen->static_keys, grid->static_keys, sizeof(*grid->static_keys));
+	frozen->static_starts = isls2d__arrcast(frozen->static_starts) isls2d__arrcopy(frozen->static_starts, grid->static_starts, sizeof(*grid->static_starts));
+	frozen->static_ids = isls2d__arrcast(frozen->static_ids) isls2d__arrcopy(frozen->static_ids, grid->static_ids, sizeof(*grid->static_ids));
+	frozen->static_categories = isls2d__arrcast(frozen->static_categories) isls2d__arrcopy(frozen->static_categories, grid->static_categories, sizeof(*grid->static_categories));
+}
+
+// Query of the frozen grid without stamps, entity spanning several cells is reported
+// only by the lowest cell shared by its range and the query range, both in cells of the
+// level of the entity. Negative radius is a rect query, otherwise x, y is the center of
+// the circle and the size is ignored
+int isls2d__snapshot_query(const struct isls2d *frozen, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	int xmin, xmax, ymin, ymax, count = 0;
+	isls2d_float bx = radius >= 0 ? x - radius : x, by = radius >= 0 ? y - radius : y;
+	if (radius >= 0) width = height = 2 * radius;
+	for (int l = 0; l <= frozen->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(frozen, l);
+		isls2d__query_range(grid, bx, by, width, height, &xmin, &xmax, &ymin, &ymax);
+		for (int cy = ymin; cy < ymax; cy++) {
+			for (int cx = xmin; cx < xmax; cx++) {
+				for (int s = 0; s < 2; s++) {
+					int n;
+					isls2d_mask categories;
+					const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, &categories);
+					if (!(categories & mask)) continue;
+					for (int i = 0; i < n; i += ISLS2D__LANES) {
+						int lanes = n - i < ISLS2D__LANES ? n - i : ISLS2D__LANES;
+						unsigned bits = isls2d__category_mask(frozen, mask, cell_ids + i, lanes);
+						if (!bits) continue;
+						bits &= isls2d__overlap_mask(frozen, bx, by, width, height, cell_ids + i, lanes);
+						for (int j = i; bits; j++, bits >>= 1) {
+							if (!(bits & 1)) continue;
+							int id = cell_ids[j];
+							struct isls2d_range r = frozen->ranges[id];
+							if ((r.xmin > xmin ? r.xmin : xmin) != cx || (r.ymin > ymin ? r.ymin : ymin) != cy) continue;
+							if (radius >= 0 && !isls2d__circle_overlaps(x, y, radius, frozen->x[id], frozen->y[id], frozen->width[id], frozen->height[id])) continue;
+							count++;
+							if (fn(id, frozen->entities[id].data, udata)) return count;
+						}
+					}
+				}
 			}
 		}
 	}
+	return count;
+}
+
+int isls2d__query_buffer_put(int id, const void *data, void *udata) {
+	struct isls2d__query_buffer *buffer = (struct isls2d__query_buffer *)udata;
+	(void)data;
+	if (buffer->count < buffer->max_ids) buffer->ids[buffer->count] = id;
+	buffer->count++;
+	return 0;
+}
+
+unsigned isls2d__query_begin(struct isls2d *sh) {
+	// Entity is stamped with the epoch of the last query which visited it, on wrap around
+	// old stamps would collide with new epochs, so they are reset
+	if (++sh->query_epoch == 0) {
+		int n = isls2d__arrlen(sh->entities);
+		for (int i = 0; i < n; i++) sh->query_stamps[i] = 0;
+		sh->query_epoch = 1;
+	}
+	return sh->query_epoch;
 }
 
 void isls2d_init(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height) {
-	*sh = (struct isls2d) {NULL, NULL, NULL, 1.0f / cell_width, 1.0f / cell_height};
+	memset(sh, 0, sizeof(*sh));
+	sh->inv_cell_width = 1.0f / cell_width;
+	sh->inv_cell_height = 1.0f / cell_height;
+}
+
+void isls2d_init_bounded(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
+	isls2d_init(sh, cell_width, cell_height);
+	int xmin, xmax, ymin, ymax;
+	isls2d__cell_range(sh, x, y, width, height, &xmin, &xmax, &ymin, &ymax);
+	sh->grid_x = xmin;
+	sh->grid_y = ymin;
+	sh->grid_width = xmax - xmin;
+	sh->grid_height = ymax - ymin;
+	sh->cells_count = sh->cells_capacity = sh->grid_width * sh->grid_height;
+	sh->cells = (struct isls2d_cell *)ISLS2D_REALLOC(NULL, sh->cells_capacity * sizeof(*sh->cells));
+	for (int cy = ymin; cy < ymax; cy++) {
+		for (int cx = xmin; cx < xmax; cx++) {
+			struct isls2d_cell *cell = isls2d__cell_get(sh, cx, cy);
+			cell->key = ISLS2D_KEY(cx, cy);
+			cell->ids = NULL;
+			cell->categories = 0;
+		}
+	}
+}
+
+void isls2d_init_hierarchical(struct isls2d *sh, isls2d_float cell_width, isls2d_float cell_height, int levels) {
+	isls2d_init(sh, cell_width, cell_height);
+	sh->levels_count = levels > 1 ? levels - 1 : 0;
+	if (sh->levels_count == 0) return;
+	sh->levels = (struct isls2d *)ISLS2D_REALLOC(NULL, sh->levels_count * sizeof(*sh->levels));
+	for (int i = 0; i < sh->levels_count; i++) {
+		cell_width *= 2;
+		cell_height *= 2;
+		isls2d_init(&sh->levels[i], cell_width, cell_height);
+	}
 }
 
 void isls2d_clear(struct isls2d *sh) {
-	int n = hmlen(sh->cells);
-	for (int i = 0; i < n; i++) {
-		arrfree(sh->cells[i].value);
+	for (int i = 0; i < sh->cells_capacity; i++) {
+		isls2d__arrfree(sh->cells[i].ids);
 	}
-	hmfree(sh->cells);
-	n = arrlen(sh->entities);
+	ISLS2D_FREE(sh->cells);
+	int n = isls2d__arrlen(sh->entities);
 	for (int i = 0; i < n; i++) {
-		//hmfree(sh->entities[i].overlaps);
-		arrfree(sh->entities[i].overlaps);
+		isls2d__arrfree(sh->entities[i].overlaps);
 		sh->entities[i].overlaps = NULL;
 	}
-	arrfree(sh->entities);
-	arrfree(sh->reusable_ids);
+	isls2d__arrfree(sh->entities);
+	isls2d__arrfree(sh->x);
+	isls2d__arrfree(sh->y);
+	isls2d__arrfree(sh->width);
+	isls2d__arrfree(sh->height);
+	isls2d__arrfree(sh->ranges);
+	isls2d__arrfree(sh->query_stamps);
+	isls2d__arrfree(sh->categories);
+	isls2d__arrfree(sh->masks);
+	isls2d__arrfree(sh->flags);
+	isls2d__arrfree(sh->reusable_ids);
+	sh->reusable_head = 0;
+	isls2d__arrfree(sh->removed_ids);
+	isls2d__arrfree(sh->pairs);
+	isls2d__arrfree(sh->began);
+	isls2d__arrfree(sh->ended);
+	isls2d__arrfree(sh->drained_began);
+	isls2d__arrfree(sh->drained_ended);
+	isls2d__arrfree(sh->overlaps_scratch);
+	isls2d__arrfree(sh->batch_ops);
+	isls2d__arrfree(sh->point_ops);
+	isls2d__arrfree(sh->flat_entries);
+	isls2d__arrfree(sh->flat_scratch);
+	isls2d__arrfree(sh->flat_keys);
+	isls2d__arrfree(sh->flat_starts);
+	isls2d__arrfree(sh->flat_ids);
+	isls2d__arrfree(sh->flat_categories);
+	isls2d__arrfree(sh->static_entries);
+	isls2d__arrfree(sh->static_keys);
+	isls2d__arrfree(sh->static_starts);
+	isls2d__arrfree(sh->static_ids);
+	isls2d__arrfree(sh->static_categories);
+	isls2d__arrfree(sh->task_counts);
+	for (int i = 0; i < isls2d__arrlen(sh->task_pairs); i++) isls2d__arrfree(sh->task_pairs[i]);
+	isls2d__arrfree(sh->task_pairs);
+	for (int i = 0; sh->shards && i < sh->locks_count; i++) isls2d_clear(&sh->shards[i]);
+	ISLS2D_FREE(sh->shards);
+	for (int i = 0; i < sh->levels_count; i++) isls2d_clear(&sh->levels[i]);
+	ISLS2D_FREE(sh->levels);
+	sh->levels = NULL;
+	sh->levels_count = 0;
+	ISLS2D_FREE(sh->locks);
+	sh->shards = NULL;
+	sh->locks = NULL;
+	sh->locks_count = 0;
+	sh->flat_dirty = false;
+	sh->static_dirty = false;
+	sh->loose_dirty = false;
 	sh->cells = NULL;
-	sh->entities = NULL;
+	sh->cells_count = 0;
+	sh->cells_capacity = 0;
+	sh->grid_width = 0;
+	sh->grid_height = 0;
 	sh->reusable_ids = NULL;
 }
 
 int isls2d_insert(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data) {
-	int id;
-	int xmin = isls2d__floor(x * sh->inv_cell_width);
-	int xmax = isls2d__ceil((x + width) * sh->inv_cell_width);
-	int ymin = isls2d__floor(y * sh->inv_cell_height);
-	int ymax = isls2d__ceil((y + height) * sh->inv_cell_height);
-	struct isls2d_entity entity = (struct isls2d_entity) {-1, x, y, width, height, xmin, xmax, ymin, ymax, data, NULL};
-	if (arrlen(sh->reusable_ids) > 0) {
-		entity.id = arrpop(sh->reusable_ids);
-		sh->entities[entity.id] = entity;
-	} else {
-		entity.id = arrlen(sh->entities);
-		arrpush(sh->entities, entity);
+	int id = isls2d__alloc_id(sh);
+	sh->entities[id] = (struct isls2d_entity) {id, data, NULL};
+	sh->categories[id] = sh->masks[id] = ISLS2D_MASK_ALL;
+	sh->flags[id] = 0;
+	sh->x[id] = x;
+	sh->y[id] = y;
+	sh->width[id] = width;
+	sh->height[id] = height;
+	isls2d__loose_extent(sh, 0, 0, width, height);
+	if (sh->rebuild_mode) {
+		sh->flat_dirty = true;
+		return id;
 	}
-	isls2d__insert_entity_into_cells(sh, id, xmin, xmax, ymin, ymax);
+	isls2d__fat_range(sh, x, y, width, height, &sh->ranges[id]);
+	isls2d__insert_entity_into_cells(sh, id, false);
+	if (sh->track_overlap) isls2d__track_overlaps(sh, id);
+	return id;
+}
+
+int isls2d_insert_static(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data) {
+	int id = isls2d__alloc_id(sh);
+	sh->entities[id] = (struct isls2d_entity) {id, data, NULL};
+	sh->categories[id] = sh->masks[id] = ISLS2D_MASK_ALL;
+	sh->flags[id] = ISLS2D__STATIC;
+	isls2d__loose_extent(sh, 0, 0, width, height);
+	isls2d__update_static(sh, id, x, y, width, height);
 	return id;
 }
 
 void isls2d_remove(struct isls2d *sh, int id) {
-	if (id >= arrlen(sh->entities)) return;
-	struct isls2d_entity entity = sh->entities[id];
-	if (entity.id != id) return;
-	isls2d__remove_entity_from_cells(sh, id, entity.xmin, entity.xmax, entity.ymin, entity.ymax);
-	sh->entities[id].id = -1;
-	int n = arrlen(sh->entities[id].overlaps);
-	for (int i = 0; i < n; i++) {
-		isls2d__arrsorted_del(sh->entities[i].overlaps, id);
+	int n = isls2d__arrlen(sh->entities);
+	if (id < 0 || id >= n) return;
+	struct isls2d_entity *entity = &sh->entities[id];
+	if (entity->id != id) return;
+	isls2d__loose_extent(sh, sh->width[id], sh->height[id], 0, 0);
+	if (sh->flags[id] & ISLS2D__STATIC) sh->static_dirty = true;
+	else if (sh->rebuild_mode) sh->flat_dirty = true;
+	else isls2d__remove_entity_from_cells(sh, id, sh->ranges[id], false);
+	int noverlaps = isls2d__arrlen(entity->overlaps);
+	for (int i = 0; i < noverlaps; i++) {
+		struct isls2d_entity *o = &sh->entities[entity->overlaps[i]];
+		o->overlaps = isls2d__arrsorted_del(o->overlaps, id);
+		isls2d__contact(&sh->ended, id, entity->overlaps[i]);
 	}
-	arrfree(sh->entities[id].overlaps);
-	sh->entities[id].overlaps = NULL;
-	if (id == arrlen(sh->entities)) {
-		(void)arrpop(sh->entities);
+	isls2d__arrfree(entity->overlaps);
+	entity->id = -1;
+	// Drained events refer to the removed entity by its id, so it waits for the drain
+	if (sh->track_overlap) {
+		isls2d__arrput(sh->removed_ids, id);
+	} else if (id == n - 1) {
+		isls2d__resize_ids(sh, n - 1);
 	} else {
-		(void)arrput(sh->reusable_ids, id);
+		isls2d__push_id(sh, id);
 	}
 }
 
 void isls2d_update(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
-	if (id >= arrlen(sh->entities)) return;
-	struct isls2d_entity entity = sh->entities[id];
-	if (entity.id != id) return;
-	int xmin = isls2d__floor(x * sh->inv_cell_width);
-	int xmax = isls2d__ceil((x + width) * sh->inv_cell_width);
-	int ymin = isls2d__floor(y * sh->inv_cell_height);
-	int ymax = isls2d__ceil((y + height) * sh->inv_cell_height);
-	if (sh->track_overlap || xmin != entity.xmin || xmax != entity.xmax || ymin != entity.ymin || ymax != entity.ymax) {
-		isls2d__remove_entity_from_cells(sh, id, entity.xmin, entity.xmax, entity.ymin, entity.ymax);
-		isls2d__insert_entity_into_cells(sh, id, xmin, xmax, ymin, ymax);
-	}
-	sh->entities[id] = (struct isls2d_entity) {entity.id, x, y, width, height, xmin, xmax, ymin, ymax, entity.data, entity.overlaps};
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	if (sh->entities[id].id != id) return;
+	if (!isls2d__touch(sh, id, x, y, width, height)) return;
+	isls2d__loose_extent(sh, sh->width[id], sh->height[id], width, height);
+	if (sh->flags[id] & ISLS2D__STATIC) {
+		isls2d__update_static(sh, id, x, y, width, height);
+		return;
+	}
+	if (sh->rebuild_mode) {
+		sh->x[id] = x;
+		sh->y[id] = y;
+		sh->width[id] = width;
+		sh->height[id] = height;
+		sh->flat_dirty = true;
+		return;
+	}
+	struct isls2d_range old = sh->ranges[id];
+	if (isls2d__update_range(sh, &sh->stats, id, x, y, width, height)) {
+		isls2d__remove_entity_from_cells(sh, id, old, false);
+		isls2d__insert_entity_into_cells(sh, id, false);
+	}
+	if (sh->track_overlap) isls2d__track_overlaps(sh, id);
+}
+
+void isls2d_update_batch(struct isls2d *sh, const int *ids, const struct isls2d_box *boxes, int n) {
+	int count = isls2d__arrlen(sh->entities);
+	// Cell changes are grouped by keys, which are ambiguous between levels
+	if (sh->rebuild_mode || sh->levels_count) {
+		for (int i = 0; i < n; i++) isls2d_update(sh, ids[i], boxes[i].x, boxes[i].y, boxes[i].width, boxes[i].height);
+		return;
+	}
+	isls2d__arrsetlen(sh->batch_ops, 0);
+	for (int i = 0; i < n; i++) {
+		int id = ids[i];
+		if (id < 0 || id >= count || sh->entities[id].id != id) continue;
+		if (!isls2d__touch(sh, id, boxes[i].x, boxes[i].y, boxes[i].width, boxes[i].height)) continue;
+		isls2d__loose_extent(sh, sh->width[id], sh->height[id], boxes[i].width, boxes[i].height);
+		if (sh->flags[id] & ISLS2D__STATIC) {
+			isls2d__update_static(sh, id, boxes[i].x, boxes[i].y, boxes[i].width, boxes[i].height);
+			continue;
+		}
+		struct isls2d_range old = sh->ranges[id];
+		if (!isls2d__update_range(sh, &sh->stats, id, boxes[i].x, boxes[i].y, boxes[i].width, boxes[i].height)) continue;
+		// Cells covered by both old and new ranges are left untouched
+		isls2d__batch_emit(sh, id, old, sh->ranges[id], false);
+		isls2d__batch_emit(sh, id, sh->ranges[id], old, true);
+	}
+	int nops = isls2d__arrlen(sh->batch_ops);
+	if (nops > 1) qsort(sh->batch_ops, nops, sizeof(*sh->batch_ops), isls2d__compare_batch_ops);
+	for (int i = 0; i < nops;) {
+		int j = i;
+		bool insert = false;
+		for (; j < nops && sh->batch_ops[j].key == sh->batch_ops[i].key; j++) insert = insert || sh->batch_ops[j].insert;
+		struct isls2d_cell *cell = insert ? isls2d__cell_put(sh, sh->batch_ops[i].x, sh->batch_ops[i].y) : isls2d__cell_get(sh, sh->batch_ops[i].x, sh->batch_ops[i].y);
+		if (cell != NULL) {
+			// Ops of the same cell keep the order of emission, so repeated ids are handled too
+			for (; i < j; i++) {
+				struct isls2d__batch_op *op = &sh->batch_ops[i];
+				if (op->insert) {
+					isls2d__arrput(cell->ids, op->id);
+					cell->categories |= sh->categories[op->id];
+					continue;
+				}
+				int ncell = isls2d__arrlen(cell->ids);
+				for (int k = 0; k < ncell; k++) {
+					if (cell->ids[k] == op->id) {
+						isls2d__arrdelswap(cell->ids, k);
+						break;
+					}
+				}
+			}
+			if (isls2d__arrlen(cell->ids) == 0) isls2d__cell_del(sh, cell);
+		}
+		i = j;
+	}
+	if (sh->track_overlap) {
+		for (int i = 0; i < n; i++) {
+			int id = ids[i];
+			if (id >= 0 && id < count && sh->entities[id].id == id && !(sh->flags[id] & ISLS2D__SLEEPING)) isls2d__track_overlaps(sh, id);
+		}
+	}
+}
+
+void isls2d_sleep(struct isls2d *sh, int id) {
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	// Overlaps of the rebuild mode are tracked on rebuild, which skips sleeping entities,
+	// so moves made before the sleep are tracked first
+	if (sh->track_overlap && sh->flat_dirty) isls2d_rebuild(sh);
+	if (sh->entities[id].id == id) sh->flags[id] |= ISLS2D__SLEEPING;
+}
+
+void isls2d_wake(struct isls2d *sh, int id) {
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	if (sh->entities[id].id != id || !(sh->flags[id] & ISLS2D__SLEEPING)) return;
+	sh->flags[id] &= ~ISLS2D__SLEEPING;
+	// Pairs with idle neighbors appear again
+	if (sh->rebuild_mode) sh->flat_dirty = sh->flat_dirty || sh->track_overlap;
+	else if (sh->track_overlap) isls2d__track_overlaps(sh, id);
+}
+
+void isls2d_set_filter(struct isls2d *sh, int id, isls2d_mask category, isls2d_mask mask) {
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	if (sh->entities[id].id != id) return;
+	sh->categories[id] = category;
+	sh->masks[id] = mask;
+	if (sh->flags[id] & ISLS2D__STATIC) sh->static_dirty = true;
+	if (sh->rebuild_mode) {
+		sh->flat_dirty = true;
+		return;
+	}
+	// Cell categories may keep the old bits until the cell empties, skipping stays correct
+	struct isls2d_range r = sh->ranges[id];
+	struct isls2d *grid = isls2d__level(sh, r.level);
+	for (int cx = r.xmin; cx < r.xmax && !(sh->flags[id] & ISLS2D__STATIC); cx++) {
+		for (int cy = r.ymin; cy < r.ymax; cy++) isls2d__cell_get(grid, cx, cy)->categories |= category;
+	}
+	if (sh->track_overlap) isls2d__track_overlaps(sh, id);
+}
+
+void isls2d_rebuild(struct isls2d *sh) {
+	struct isls2d__job job = {sh, sh->tasks > 1 ? sh->tasks : 1, 0};
+	isls2d__arrsetlen(sh->task_counts, job.tasks * 256);
+	isls2d__run(sh, isls2d__rebuild_count_task, &job);
+	int n = isls2d__prefix_sum(sh, job.tasks);
+	isls2d__arrsetlen(sh->flat_entries, n);
+	isls2d__arrsetlen(sh->flat_scratch, n);
+	isls2d__run(sh, isls2d__rebuild_emit_task, &job);
+	for (job.shift = 0; job.shift < (int)sizeof(isls2d_key) * 8; job.shift += 8) {
+		isls2d__run(sh, isls2d__radix_count_task, &job);
+		// Pass is skipped when all keys share the digit
+		int d = n ? (int)(((isls2d__ukey)sh->flat_entries[0].key >> job.shift) & 0xff) : 0, total = 0;
+		for (int i = 0; i < job.tasks; i++) total += sh->task_counts[i * 256 + d];
+		if (total == n) continue;
+		for (int digit = 0, offset = 0; digit < 256; digit++) {
+			for (int i = 0; i < job.tasks; i++) {
+				int count = sh->task_counts[i * 256 + digit];
+				sh->task_counts[i * 256 + digit] = offset;
+				offset += count;
+			}
+		}
+		isls2d__run(sh, isls2d__radix_scatter_task, &job);
+		struct isls2d__flat_entry *sorted = sh->flat_scratch;
+		sh->flat_scratch = sh->flat_entries;
+		sh->flat_entries = sorted;
+	}
+	isls2d__arrsetlen(sh->flat_ids, n);
+	isls2d__run(sh, isls2d__cells_count_task, &job);
+	int ncells = isls2d__prefix_sum(sh, job.tasks);
+	isls2d__arrsetlen(sh->flat_keys, ncells);
+	isls2d__arrsetlen(sh->flat_starts, ncells + 1);
+	isls2d__arrsetlen(sh->flat_categories, ncells);
+	isls2d__run(sh, isls2d__cells_emit_task, &job);
+	sh->flat_starts[ncells] = n;
+	sh->flat_dirty = false;
+	if (sh->track_overlap) {
+		// Overlaps of idle entities with moving ones are tracked by the moving side
+		int count = isls2d__arrlen(sh->entities);
+		for (int id = 0; id < count; id++) {
+			if (sh->entities[id].id == id && !(sh->flags[id] & ISLS2D__IDLE)) isls2d__track_overlaps(sh, id);
+		}
+	}
+}
+
+void isls2d_reserve(struct isls2d *sh, int capacity) {
+	int n = isls2d__arrlen(sh->entities);
+	if (capacity <= n) return;
+	isls2d__resize_ids(sh, capacity);
+	// Pushed in reverse, so lower ids are taken first
+	for (int id = capacity - 1; id >= n; id--) {
+		struct isls2d_entity entity = {-1, NULL, NULL};
+		sh->entities[id] = entity;
+		sh->query_stamps[id] = 0;
+		isls2d__push_id(sh, id);
+	}
+}
+
+void isls2d_shard(struct isls2d *sh, int shards) {
+	sh->locks_count = shards > 1 ? shards : 1;
+	sh->locks = (int *)ISLS2D_REALLOC(NULL, sh->locks_count * sizeof(*sh->locks));
+	memset(sh->locks, 0, sh->locks_count * sizeof(*sh->locks));
+	if (sh->grid_width) return;
+	sh->shards = (struct isls2d *)ISLS2D_REALLOC(NULL, sh->locks_count * sizeof(*sh->shards));
+	for (int i = 0; i < sh->locks_count; i++) isls2d_init(&sh->shards[i], 1, 1);
+}
+
+int isls2d_insert_concurrent(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, const void *data) {
+	int id = isls2d__pop_id(sh);
+	if (id < 0) return -1;
+	struct isls2d_entity entity = {id, data, NULL};
+	sh->entities[id] = entity;
+	sh->categories[id] = sh->masks[id] = ISLS2D_MASK_ALL;
+	sh->flags[id] = 0;
+	sh->x[id] = x;
+	sh->y[id] = y;
+	sh->width[id] = width;
+	sh->height[id] = height;
+	isls2d__fat_range(sh, x, y, width, height, &sh->ranges[id]);
+	isls2d__insert_entity_into_cells(sh, id, true);
+	return id;
+}
+
+void isls2d_remove_concurrent(struct isls2d *sh, int id) {
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	if (sh->entities[id].id != id) return;
+	isls2d__remove_entity_from_cells(sh, id, sh->ranges[id], true);
+	isls2d__arrfree(sh->entities[id].overlaps);
+	sh->entities[id].id = -1;
+	isls2d__push_id(sh, id);
+}
+
+void isls2d_update_concurrent(struct isls2d *sh, int id, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height) {
+	if (id < 0 || id >= isls2d__arrlen(sh->entities)) return;
+	if (sh->entities[id].id != id) return;
+	if (!isls2d__touch(sh, id, x, y, width, height)) return;
+	struct isls2d_range old = sh->ranges[id];
+	struct isls2d_stats stats = {0, 0};
+	if (isls2d__update_range(sh, &stats, id, x, y, width, height)) {
+		isls2d__remove_entity_from_cells(sh, id, old, true);
+		isls2d__insert_entity_into_cells(sh, id, true);
+	}
+	if (stats.rebuckets) isls2d__atomic_add64(&sh->stats.rebuckets, stats.rebuckets);
+	if (stats.rebuckets_avoided) isls2d__atomic_add64(&sh->stats.rebuckets_avoided, stats.rebuckets_avoided);
+}
+
+int isls2d_query_rect(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, int *ids, int max_ids) {
+	struct isls2d__query_buffer buffer = {ids, max_ids, 0};
+	isls2d_query_rect_each(sh, x, y, width, height, mask, isls2d__query_buffer_put, &buffer);
+	return buffer.count;
+}
+
+int isls2d_query_rect_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	return isls2d__query(sh, x, y, width, height, -1, mask, false, fn, udata);
+}
+
+int isls2d_query_circle(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, int *ids, int max_ids) {
+	struct isls2d__query_buffer buffer = {ids, max_ids, 0};
+	isls2d__query(sh, x, y, 0, 0, radius, mask, false, isls2d__query_buffer_put, &buffer);
+	return buffer.count;
+}
+
+int isls2d_query_circle_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	return isls2d__query(sh, x, y, 0, 0, radius, mask, false, fn, udata);
+}
+
+bool isls2d_query_rect_any(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask) {
+	return isls2d__query(sh, x, y, width, height, -1, mask, true, NULL, NULL) > 0;
+}
+
+int isls2d_query_rect_count(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask) {
+	return isls2d__query(sh, x, y, width, height, -1, mask, false, NULL, NULL);
+}
+
+bool isls2d_query_circle_any(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask) {
+	return isls2d__query(sh, x, y, 0, 0, radius, mask, true, NULL, NULL) > 0;
+}
+
+int isls2d_query_circle_count(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask) {
+	return isls2d__query(sh, x, y, 0, 0, radius, mask, false, NULL, NULL);
+}
+
+int isls2d_query_point(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_mask mask, int *ids, int max_ids) {
+	struct isls2d__query_buffer buffer = {ids, max_ids, 0};
+	isls2d_query_point_each(sh, x, y, mask, isls2d__query_buffer_put, &buffer);
+	return buffer.count;
+}
+
+int isls2d_query_point_each(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	int xmin, xmax, ymin, ymax, n, count = 0;
+	isls2d__refresh(sh);
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		// Single cell of the point unless the grid is loose
+		isls2d__query_range(grid, x, y, 0, 0, &xmin, &xmax, &ymin, &ymax);
+		for (int cx = xmin; cx < xmax; cx++) {
+			for (int cy = ymin; cy < ymax; cy++) {
+				for (int s = 0; s < 2; s++) {
+					const int *cell_ids = isls2d__cell_ids(grid, cx, cy, s, &n, NULL);
+					for (int i = 0; i < n; i++) {
+						int id = cell_ids[i];
+						if (!(sh->categories[id] & mask)) continue;
+						if (x < sh->x[id] || x >= sh->x[id] + sh->width[id] || y < sh->y[id] || y >= sh->y[id] + sh->height[id]) continue;
+						count++;
+						if (fn(id, sh->entities[id].data, udata)) return count;
+					}
+				}
+			}
+		}
+	}
+	return count;
+}
+
+int isls2d_query_points_each(struct isls2d *sh, const struct isls2d_point *points, int n, isls2d_mask mask, isls2d_point_query_fn fn, void *udata) {
+	int count = 0;
+	isls2d__refresh(sh);
+	// Points are sorted by cells of every level separately
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		isls2d__arrsetlen(sh->point_ops, n);
+		for (int i = 0; i < n; i++) {
+			struct isls2d__point_op *op = &sh->point_ops[i];
+			isls2d__point_cell(grid, points[i].x, points[i].y, &op->x, &op->y);
+			op->key = ISLS2D_KEY(op->x, op->y);
+			op->index = i;
+		}
+		if (n > 1) qsort(sh->point_ops, n, sizeof(*sh->point_ops), isls2d__compare_point_ops);
+		int ncell[2] = {0, 0};
+		const int *cell_ids[2] = {NULL, NULL};
+		for (int i = 0; i < n; i++) {
+			struct isls2d__point_op op = sh->point_ops[i];
+			isls2d_float x = points[op.index].x, y = points[op.index].y;
+			int xmin, xmax, ymin, ymax;
+			// Loose grid looks into the neighbor cells too, so lookups aren't shared
+			bool shared = !grid->loose && i > 0 && op.key == sh->point_ops[i - 1].key;
+			isls2d__query_range(grid, x, y, 0, 0, &xmin, &xmax, &ymin, &ymax);
+			for (int cx = xmin; cx < xmax; cx++) {
+				for (int cy = ymin; cy < ymax; cy++) {
+					for (int s = 0; s < 2; s++) {
+						if (!shared) cell_ids[s] = isls2d__cell_ids(grid, cx, cy, s, &ncell[s], NULL);
+						for (int j = 0; j < ncell[s]; j++) {
+							int id = cell_ids[s][j];
+							if (!(sh->categories[id] & mask)) continue;
+							if (x < sh->x[id] || x >= sh->x[id] + sh->width[id] || y < sh->y[id] || y >= sh->y[id] + sh->height[id]) continue;
+							count++;
+							if (fn(op.index, id, sh->entities[id].data, udata)) return count;
+						}
+					}
+				}
+			}
+		}
+	}
+	return count;
+}
+
+int isls2d_raycast(struct isls2d *sh, isls2d_float x, isls2d_float y, isls2d_float dx, isls2d_float dy, isls2d_float max_t, isls2d_mask mask, struct isls2d_hit *hits, int max_hits) {
+	int count = 0;
+	isls2d__refresh(sh);
+	if (max_hits <= 0) return 0;
+	unsigned epoch = isls2d__query_begin(sh);
+	isls2d_float inv_dx = dx != 0 ? 1 / dx : 0, inv_dy = dy != 0 ? 1 / dy : 0, walk_t = max_t;
+	bool clipped = false;
+	// Every level is walked separately with its own cells, hits are merged
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		isls2d_float cell_width = 1 / grid->inv_cell_width, cell_height = 1 / grid->inv_cell_height;
+		int cx = isls2d__floor(x * grid->inv_cell_width), cy = isls2d__floor(y * grid->inv_cell_height);
+		int step_x = dx > 0 ? 1 : (dx < 0 ? -1 : 0), step_y = dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+		// Ray parameters of the next vertical and horizontal cell borders and their spacing
+		isls2d_float next_x = ((step_x > 0 ? cx + 1 : cx) * cell_width - x) * inv_dx, delta_x = cell_width * inv_dx * step_x;
+		isls2d_float next_y = ((step_y > 0 ? cy + 1 : cy) * cell_height - y) * inv_dy, delta_y = cell_height * inv_dy * step_y;
+		// Long walk over the hashed grid is cut where the ray leaves the box of entities
+		if (!grid->grid_width && !clipped && max_t * ((dx < 0 ? -dx : dx) * grid->inv_cell_width + (dy < 0 ? -dy : dy) * grid->inv_cell_height) > isls2d__arrlen(sh->entities)) {
+			walk_t = isls2d__ray_extent(sh, x, y, inv_dx, inv_dy, dx, dy, max_t);
+			clipped = true;
+		}
+		for (;;) {
+			// Outside of the bounded grid and moving away the ray stays in the same border
+			// cells along the axis, so it doesn't step along it anymore
+			if (grid->grid_width) {
+				if ((cx < grid->grid_x && step_x < 0) || (cx >= grid->grid_x + grid->grid_width && step_x > 0)) step_x = 0;
+				if ((cy < grid->grid_y && step_y < 0) || (cy >= grid->grid_y + grid->grid_height && step_y > 0)) step_y = 0;
+			}
+			bool along_x = step_x && (!step_y || next_x < next_y);
+			isls2d_float exit_t = along_x ? next_x : (step_y ? next_y : max_t);
+			int lx = cx, ly = cy, n;
+			if (grid->grid_width) {
+				// Outside of the bounded grid ray walks over the border cells
+				if (lx < grid->grid_x) lx = grid->grid_x; else if (lx >= grid->grid_x + grid->grid_width) lx = grid->grid_x + grid->grid_width - 1;
+				if (ly < grid->grid_y) ly = grid->grid_y; else if (ly >= grid->grid_y + grid->grid_height) ly = grid->grid_y + grid->grid_height - 1;
+			}
+			int xmin = lx, xmax = lx + 1, ymin = ly, ymax = ly + 1;
+			// Loose entities reaching into the cell have their centers in the neighbor cells
+			if (grid->loose) isls2d__query_range(grid, cx * cell_width, cy * cell_height, cell_width, cell_height, &xmin, &xmax, &ymin, &ymax);
+			for (int qx = xmin; qx < xmax; qx++) {
+				for (int qy = ymin; qy < ymax; qy++) {
+					for (int s = 0; s < 2; s++) {
+						const int *cell_ids = isls2d__cell_ids(grid, qx, qy, s, &n, NULL);
+						for (int i = 0; i < n; i++) {
+							int id = cell_ids[i];
+							if (sh->query_stamps[id] == epoch || !(sh->categories[id] & mask)) continue;
+							sh->query_stamps[id] = epoch;
+							// Slab test, ray parallel to the slab hits only when it starts inside of it
+							isls2d_float tmin = 0, tmax = max_t;
+							if (dx != 0) {
+								isls2d_float t1 = (sh->x[id] - x) * inv_dx, t2 = (sh->x[id] + sh->width[id] - x) * inv_dx;
+								if (t1 > t2) { isls2d_float t = t1; t1 = t2; t2 = t; }
+								if (t1 > tmin) tmin = t1;
+								if (t2 < tmax) tmax = t2;
+							} else if (x < sh->x[id] || x > sh->x[id] + sh->width[id]) {
+								continue;
+							}
+							if (dy != 0) {
+								isls2d_float t1 = (sh->y[id] - y) * inv_dy, t2 = (sh->y[id] + sh->height[id] - y) * inv_dy;
+								if (t1 > t2) { isls2d_float t = t1; t1 = t2; t2 = t; }
+								if (t1 > tmin) tmin = t1;
+								if (t2 < tmax) tmax = t2;
+							} else if (y < sh->y[id] || y > sh->y[id] + sh->height[id]) {
+								continue;
+							}
+							if (tmin > tmax) continue;
+							// Hits are kept sorted, when the buffer is full the farthest one is dropped
+							if (count == max_hits && tmin >= hits[count - 1].t) continue;
+							int k = count < max_hits ? count++ : count - 1;
+							for (; k > 0 && hits[k - 1].t > tmin; k--) hits[k] = hits[k - 1];
+							hits[k].id = id;
+							hits[k].t = tmin;
+						}
+					}
+				}
+			}
+			if (exit_t >= walk_t) break;
+			if (count == max_hits && hits[count - 1].t <= exit_t) break;
+			if (along_x) {
+				cx += step_x;
+				next_x += delta_x;
+			} else {
+				cy += step_y;
+				next_y += delta_y;
+			}
+		}
+	}
+	return count;
+}
+
+int isls2d_query_knn(struct isls2d *sh, isls2d_float x, isls2d_float y, int k, isls2d_float max_distance, isls2d_mask mask, struct isls2d_neighbor *neighbors) {
+	int count = 0;
+	isls2d__refresh(sh);
+	if (k <= 0) return 0;
+	unsigned epoch = isls2d__query_begin(sh);
+	// Every level is searched by rings of its own cells into the same heap
+	for (int l = 0; l <= sh->levels_count; l++) {
+		const struct isls2d *grid = isls2d__level(sh, l);
+		isls2d_float cell_width = 1 / grid->inv_cell_width, cell_height = 1 / grid->inv_cell_height;
+		int px = isls2d__floor(x * grid->inv_cell_width), py = isls2d__floor(y * grid->inv_cell_height);
+		int occupied = (grid->rebuild_mode ? isls2d__arrlen(grid->flat_keys) : grid->cells_count) + isls2d__arrlen(grid->static_keys), seen = 0;
+		for (int s = 0; grid->shards && s < grid->locks_count; s++) occupied += grid->shards[s].cells_count;
+		// Ring costs grow with the distance to the farthest cell, all cells are cheaper to scan
+		// once the square of rings has more cells than the level
+		int cells = grid->grid_width ? grid->grid_width * grid->grid_height : occupied;
+		for (int r = 0;; r++) {
+			if (r > 0) {
+				// Distance from the point to the ring is the distance to the inner square
+				isls2d_float ring = x - (px - r + 1) * cell_width, d;
+				if ((d = (px + r) * cell_width - x) < ring) ring = d;
+				if ((d = y - (py - r + 1) * cell_height) < ring) ring = d;
+				if ((d = (py + r) * cell_height - y) < ring) ring = d;
+				// Loose entities reach out of their cells by half of the largest size
+				if (grid->loose) ring -= 0.5f * (grid->loose_width > grid->loose_height ? grid->loose_width : grid->loose_height);
+				if (ring < 0) ring = 0;
+				if (ring > max_distance) break;
+				if (count == k && ring * ring >= neighbors[0].distance) break;
+			}
+			if (!grid->grid_width && seen == occupied) break;
+			if ((2 * r + 1) * (2 * r + 1) > cells) {
+				isls2d__knn_scan(sh, grid, x, y, mask, epoch, max_distance * max_distance, neighbors, k, &count);
+				break;
+			}
+			for (int cx = px - r; cx <= px + r; cx++) {
+				seen += isls2d__knn_cell(sh, grid, x, y, cx, py - r, mask, epoch, max_distance * max_distance, neighbors, k, &count);
+				if (r > 0) seen += isls2d__knn_cell(sh, grid, x, y, cx, py + r, mask, epoch, max_distance * max_distance, neighbors, k, &count);
+			}
+			for (int cy = py - r + 1; cy < py + r; cy++) {
+				seen += isls2d__knn_cell(sh, grid, x, y, px - r, cy, mask, epoch, max_distance * max_distance, neighbors, k, &count);
+				seen += isls2d__knn_cell(sh, grid, x, y, px + r, cy, mask, epoch, max_distance * max_distance, neighbors, k, &count);
+			}
+			// Bounded grid is fully seen once the rings cover it, outer cells are clamped
+			if (grid->grid_width && px - r <= grid->grid_x && px + r >= grid->grid_x + grid->grid_width - 1 && py - r <= grid->grid_y && py + r >= grid->grid_y + grid->grid_height - 1) break;
+		}
+	}
+	if (count > 1) qsort(neighbors, count, sizeof(*neighbors), isls2d__compare_neighbors);
+	for (int i = 0; i < count; i++) neighbors[i].distance = isls2d__sqrt(neighbors[i].distance);
+	return count;
+}
+
+int isls2d_find_pairs(struct isls2d *sh, const struct isls2d_pair **pairs) {
+	isls2d__refresh(sh);
+	struct isls2d__job job = {sh, sh->tasks > 1 ? sh->tasks : 1, 0};
+	int ntask_pairs = isls2d__arrlen(sh->task_pairs);
+	if (job.tasks > ntask_pairs) {
+		isls2d__arrsetlen(sh->task_pairs, job.tasks);
+		for (int i = ntask_pairs; i < job.tasks; i++) sh->task_pairs[i] = NULL;
+	}
+	isls2d__run(sh, isls2d__pairs_task, &job);
+	if (job.tasks > 1) {
+		isls2d__arrsetlen(sh->pairs, 0);
+		for (int i = 0; i < job.tasks; i++) {
+			int n = isls2d__arrlen(sh->pairs), m = isls2d__arrlen(sh->task_pairs[i]);
+			if (m == 0) continue;
+			isls2d__arrsetlen(sh->pairs, n + m);
+			memcpy(sh->pairs + n, sh->task_pairs[i], m * sizeof(*sh->pairs));
+		}
+	}
+	*pairs = sh->pairs;
+	return isls2d__arrlen(sh->pairs);
+}
+
+struct isls2d_contacts isls2d_drain_contacts(struct isls2d *sh) {
+	isls2d__refresh(sh);
+	struct isls2d_pair *began = sh->began, *ended = sh->ended;
+	sh->began = sh->drained_began;
+	sh->ended = sh->drained_ended;
+	isls2d__arrsetlen(sh->began, 0);
+	isls2d__arrsetlen(sh->ended, 0);
+	sh->drained_began = began;
+	sh->drained_ended = ended;
+	isls2d__net_contacts(began, ended);
+	for (int i = 0; i < isls2d__arrlen(sh->removed_ids); i++) isls2d__push_id(sh, sh->removed_ids[i]);
+	isls2d__arrsetlen(sh->removed_ids, 0);
+	struct isls2d_contacts contacts = {began, isls2d__arrlen(began), ended, isls2d__arrlen(ended)};
+	return contacts;
+}
+
+void isls2d_snapshot_take(struct isls2d *sh, struct isls2d_snapshot *snap) {
+	struct isls2d *frozen = &snap->frozen;
+	isls2d__refresh(sh);
+	// Levels of the snapshot are kept between takes while their count is the same
+	if (frozen->levels_count != sh->levels_count) {
+		for (int i = 0; i < frozen->levels_count; i++) isls2d_clear(&frozen->levels[i]);
+		ISLS2D_FREE(frozen->levels);
+		frozen->levels = NULL;
+		frozen->levels_count = sh->levels_count;
+		if (sh->levels_count) {
+			frozen->levels = (struct isls2d *)ISLS2D_REALLOC(NULL, sh->levels_count * sizeof(*frozen->levels));
+			memset(frozen->levels, 0, sh->levels_count * sizeof(*frozen->levels));
+		}
+	}
+	for (int l = 0; l <= sh->levels_count; l++) isls2d__snapshot_level(isls2d__level(sh, l), isls2d__level(frozen, l));
+	frozen->parallel = sh->parallel;
+	frozen->parallel_udata = sh->parallel_udata;
+	frozen->tasks = sh->tasks;
+	frozen->entities = isls2d__arrcast(frozen->entities) isls2d__arrcopy(frozen->entities, sh->entities, sizeof(*sh->entities));
+	frozen->x = isls2d__arrcast(frozen->x) isls2d__arrcopy(frozen->x, sh->x, sizeof(*sh->x));
+	frozen->y = isls2d__arrcast(frozen->y) isls2d__arrcopy(frozen->y, sh->y, sizeof(*sh->y));
+	frozen->width = isls2d__arrcast(frozen->width) isls2d__arrcopy(frozen->width, sh->width, sizeof(*sh->width));
+	frozen->height = isls2d__arrcast(frozen->height) isls2d__arrcopy(frozen->height, sh->height, sizeof(*sh->height));
+	frozen->categories = isls2d__arrcast(frozen->categories) isls2d__arrcopy(frozen->categories, sh->categories, sizeof(*sh->categories));
+	frozen->masks = isls2d__arrcast(frozen->masks) isls2d__arrcopy(frozen->masks, sh->masks, sizeof(*sh->masks));
+	frozen->flags = isls2d__arrcast(frozen->flags) isls2d__arrcopy(frozen->flags, sh->flags, sizeof(*sh->flags));
+	frozen->ranges = isls2d__arrcast(frozen->ranges) isls2d__arrcopy(frozen->ranges, sh->ranges, sizeof(*sh->ranges));
+	int n = isls2d__arrlen(frozen->entities);
+	for (int i = 0; i < n; i++) frozen->entities[i].overlaps = NULL;
+	// Grid in rebuild mode already has sorted cells, otherwise snapshot sorts its own,
+	// static cells are always sorted
+	if (sh->rebuild_mode) {
+		frozen->flat_keys = isls2d__arrcast(frozen->flat_keys) isls2d__arrcopy(frozen->flat_keys, sh->flat_keys, sizeof(*sh->flat_keys));
+		frozen->flat_starts = isls2d__arrcast(frozen->flat_starts) isls2d__arrcopy(frozen->flat_starts, sh->flat_starts, sizeof(*sh->flat_starts));
+		frozen->flat_ids = isls2d__arrcast(frozen->flat_ids) isls2d__arrcopy(frozen->flat_ids, sh->flat_ids, sizeof(*sh->flat_ids));
+		frozen->flat_categories = isls2d__arrcast(frozen->flat_categories) isls2d__arrcopy(frozen->flat_categories, sh->flat_categories, sizeof(*sh->flat_categories));
+	} else if (sh->levels_count) {
+		// Rebuild puts everything into the lowest level, so entities are sorted into cells
+		// of the levels they already have in their ranges
+		for (int l = 0; l <= frozen->levels_count; l++) isls2d__arrsetlen(isls2d__level(frozen, l)->flat_entries, 0);
+		for (int id = 0; id < n; id++) {
+			if (frozen->entities[id].id != id || (frozen->flags[id] & ISLS2D__STATIC)) continue;
+			struct isls2d_range r = frozen->ranges[id];
+			struct isls2d *grid = isls2d__level(frozen, r.level);
+			for (int cx = r.xmin; cx < r.xmax; cx++) {
+				for (int cy = r.ymin; cy < r.ymax; cy++) {
+					struct isls2d__flat_entry entry = {ISLS2D_KEY(cx, cy), id};
+					isls2d__arrput(grid->flat_entries, entry);
+				}
+			}
+		}
+		for (int l = 0; l <= frozen->levels_count; l++) {
+			struct isls2d *grid = isls2d__level(frozen, l);
+			isls2d__sort_cells(frozen, grid->flat_entries, &grid->flat_keys, &grid->flat_starts, &grid->flat_ids, &grid->flat_categories);
+		}
+	} else {
+		isls2d_rebuild(frozen);
+	}
+}
+
+void isls2d_snapshot_clear(struct isls2d_snapshot *snap) {
+	isls2d_clear(&snap->frozen);
+}
+
+int isls2d_snapshot_query_rect(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, int *ids, int max_ids) {
+	struct isls2d__query_buffer buffer = {ids, max_ids, 0};
+	isls2d__snapshot_query(&snap->frozen, x, y, width, height, -1, mask, isls2d__query_buffer_put, &buffer);
+	return buffer.count;
+}
+
+int isls2d_snapshot_query_rect_each(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float width, isls2d_float height, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	return isls2d__snapshot_query(&snap->frozen, x, y, width, height, -1, mask, fn, udata);
+}
+
+int isls2d_snapshot_query_circle(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, int *ids, int max_ids) {
+	struct isls2d__query_buffer buffer = {ids, max_ids, 0};
+	isls2d__snapshot_query(&snap->frozen, x, y, 0, 0, radius, mask, isls2d__query_buffer_put, &buffer);
+	return buffer.count;
+}
+
+int isls2d_snapshot_query_circle_each(const struct isls2d_snapshot *snap, isls2d_float x, isls2d_float y, isls2d_float radius, isls2d_mask mask, isls2d_query_fn fn, void *udata) {
+	return isls2d__snapshot_query(&snap->frozen, x, y, 0, 0, radius, mask, fn, udata);
 }
 
 /*